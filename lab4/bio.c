@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a set of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -17,42 +17,157 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// Buffers are found through a hash table on (dev, blockno) with
+// a lock per bucket, so lookups of different blocks do not contend.
+// binit sizes the cache at 1/BUFMEM of free memory, and at least
+// NBUF buffers.  A buffer to recycle is chosen by a clock sweep
+// over a ring of all buffers, passing over those used since the
+// hand last came by.  Recycling moves a buffer between two buckets;
+// bcache.evict serializes it, so only the evicting process ever
+// holds two bucket locks and they cannot deadlock.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
 
-struct {
-  struct spinlock lock;
-  struct buf buf[NBUF];
+#define NBUCKET 251
+#define NODEV   0xFFFFFFFF  // dev of a buffer that holds no block
+
+struct bucket {
+  struct spinlock lock;  // protects the chain and refcnt, used,
+                         // dev and blockno of the buffers on it
+  struct buf *head;
+};
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+struct {
+  struct bucket bucket[NBUCKET];
+  struct spinlock evict; // one recycler at a time; protects hand
+  struct buf *hand;      // clock hand into the ring
+  uint nbuf;
 } bcache;
 
+struct bdevsw bdevsw[NBDEV];
+
+static struct bucket*
+bhash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev*31 + blockno) % NBUCKET];
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct buf *b, *last;
+  struct bucket *bk;
+  char *mem = 0;
+  uint i, n;
 
-  initlock(&bcache.lock, "bcache");
+  for(i = 0; i < NBUCKET; i++)
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+  initlock(&bcache.evict, "bcache");
 
-//PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  n = kfreecount() / BUFMEM * (PGSIZE / sizeof(struct buf));
+  if(n < NBUF)
+    n = NBUF;
+
+  // Carve the buffers out of whole pages and link them into the
+  // clock ring.  They start out holding no block.
+  bk = bhash(NODEV, 0);
+  last = 0;
+  for(i = 0; i < n; i++){
+    if(i % (PGSIZE / sizeof(struct buf)) == 0 && (mem = kalloc()) == 0)
+      break;
+    b = (struct buf*)mem + i % (PGSIZE / sizeof(struct buf));
+    memset(b, 0, sizeof(*b));
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->dev = NODEV;
+    b->hnext = bk->head;
+    bk->head = b;
+    b->next = last;
+    last = b;
   }
+  if(i < NBUF)
+    panic("binit");
+  bcache.nbuf = i;
+  for(b = last; b->next; b = b->next)
+    ;
+  b->next = last;
+  bcache.hand = last;
+}
+
+// Look for block blockno of dev in bucket bk.  If it is there,
+// add a reference and return it.  Caller must hold bk->lock.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->hnext){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      b->used = 1;
+      return b;
+    }
+  }
+  return 0;
+}
+
+// Take a buffer nobody uses off its bucket and return it, or 0
+// if all are in use.
+// Caller must hold bcache.evict and bk->lock; bk is left locked.
+static struct buf*
+bevict(struct bucket *bk)
+{
+  struct buf *b, **pb;
+  struct bucket *ob;
+  uint i;
+
+  // Two turns: the first may only clear used bits.
+  for(i = 0; i < 2*bcache.nbuf; i++){
+    b = bcache.hand;
+    bcache.hand = b->next;
+    ob = bhash(b->dev, b->blockno);
+    if(ob != bk)
+      acquire(&ob->lock);
+    // Even if refcnt==0, B_DIRTY indicates a buffer is in use
+    // because log.c has modified it but not yet committed it.
+    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0){
+      if(b->used)
+        b->used = 0;
+      else {
+        for(pb = &ob->head; *pb != b; pb = &(*pb)->hnext)
+          ;
+        *pb = b->hnext;
+        if(ob != bk)
+          release(&ob->lock);
+        return b;
+      }
+    }
+    if(ob != bk)
+      release(&ob->lock);
+  }
+  return 0;
+}
+
+// Make b, just taken off its bucket by bevict, hold block blockno
+// of dev, with one reference, and put it on bk.
+// Caller must hold bk->lock.
+static void
+binsert(struct bucket *bk, struct buf *b, uint dev, uint blockno)
+{
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = 0;
+  b->refcnt = 1;
+  b->used = 1;
+  b->hnext = bk->head;
+  bk->head = b;
 }
 
 // Look through buffer cache for block on device dev.
@@ -61,35 +176,90 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
+  struct bucket *bk;
   struct buf *b;
 
-  acquire(&bcache.lock);
+  bk = bhash(dev, blockno);
+  acquire(&bk->lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if((b = bfind(bk, dev, blockno)) != 0){
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bk->lock);
 
-  // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  // Not cached; recycle an unused buffer.  Look again first:
+  // another process may have read it in the meantime.
+  acquire(&bcache.evict);
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) == 0){
+    if((b = bevict(bk)) == 0)
+      panic("bget: no buffers");
+    binsert(bk, b, dev, blockno);
+  }
+  release(&bk->lock);
+  release(&bcache.evict);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Return a locked buf for block blockno of dev without reading
+// it, for a caller that is going to overwrite all of it.
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  return bget(dev, blockno);
+}
+
+// Start reading block blockno of dev into the cache, unless it
+// is there already, and return without waiting for the disk.
+// Does nothing if no buffer is free.
+void
+bprefetch(uint dev, uint blockno)
+{
+  struct bucket *bk;
+  struct buf *b;
+
+  bk = bhash(dev, blockno);
+  acquire(&bcache.evict);
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->hnext)
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  if(b)
+    b = 0;  // cached, or being read already
+  else if((b = bevict(bk)) != 0)
+    binsert(bk, b, dev, blockno);
+  release(&bk->lock);
+  release(&bcache.evict);
+  if(b == 0)
+    return;
+
+  // Once b is on its bucket, a bread of the same block can find
+  // it and take the lock first, and read (or a bnew fill) it; then
+  // there is nothing left to do.
+  acquiresleep(&b->lock);
+  if(b->flags & (B_VALID|B_DIRTY)){
+    brelse(b);
+    return;
   }
-  panic("bget: no buffers");
+  b->flags |= B_ASYNC;
+  diskrw(b);
+}
+
+// Sync b with the disk it belongs to, through that disk's driver:
+// if B_DIRTY is set, write b, clear B_DIRTY and set B_VALID;
+// else if B_VALID is not set, read b and set B_VALID.
+// With B_ASYNC the driver only queues the request, and releases
+// b with bdone when it is done.
+void
+diskrw(struct buf *b)
+{
+  if(b->dev >= NBDEV || bdevsw[b->dev].rw == 0)
+    panic("diskrw: no disk");
+  bdevsw[b->dev].rw(b);
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -100,7 +270,7 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if((b->flags & B_VALID) == 0) {
-    iderw(b);
+    diskrw(b);
   }
   return b;
 }
@@ -112,33 +282,56 @@ bwrite(struct buf *b)
   if(!holdingsleep(&b->lock))
     panic("bwrite");
   b->flags |= B_DIRTY;
-  iderw(b);
+  diskrw(b);
+}
+
+// Start writing b's contents to disk and release b, without
+// waiting for the write.  Must be locked.  Queuing several writes
+// before waiting lets the disk driver merge adjacent blocks.
+void
+bawrite(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bawrite");
+  b->flags |= B_DIRTY|B_ASYNC;
+  diskrw(b);
+}
+
+// Wait until a write of block blockno of dev started by bawrite
+// has finished.
+void
+bwait(uint dev, uint blockno)
+{
+  // The buffer stays locked until the write is done.  If it has
+  // been recycled since, the write is long done.
+  brelse(bget(dev, blockno));
 }
 
 // Release a locked buffer.
-// Move to the head of the MRU list.
+// The clock hand gives it a second chance before recycling it.
 void
 brelse(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("brelse");
+  bdone(b);
+}
+
+// Release b on behalf of whoever locked it.  The disk driver
+// calls this when a B_ASYNC request finishes.
+void
+bdone(struct buf *b)
+{
+  struct bucket *bk;
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  // dev and blockno cannot change while we hold a reference.
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  b->used = 1;
+  release(&bk->lock);
 }
 //PAGEBREAK!
 // Blank page.
-
@@ -4,11 +4,21 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  uint used;         // referenced since the clock hand last passed
+  struct buf *hnext; // hash chain
+  struct buf *next;  // clock ring of all buffers
   struct buf *qnext; // disk queue
   uchar data[BSIZE];
 };
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_ASYNC 0x8  // diskrw returns at once; the disk driver releases it
+
+// Block device switch: the driver of each disk, filled in
+// by the drivers' init functions.  See diskrw.
+struct bdevsw {
+  void (*rw)(struct buf*);
+};
+
+extern struct bdevsw bdevsw[];
 
@@ -0,0 +1,77 @@
+// Context switch benchmark.
+//
+// Two processes bounce a byte back and forth over a pair of pipes,
+// so every round trip is two switches through the scheduler and
+// two page table loads.  Run with an optional round-trip count:
+//    ctxbench [n]
+// It measures cycles per round trip only; it does not count TLB
+// refills, and the cycles include everything else a switch costs.
+// With the kernel's mappings global (CR4_PGE) a switch should
+// leave their TLB entries in place; to see whether that shows in
+// the cycles, compare with a kernel built with
+//    make clean; make NOPGE=1 CPUS=1 qemu
+// where every switch flushes them too.  No such comparison has
+// been recorded yet.  Under QEMU's emulation TLB misses cost
+// little, so it needs KVM or real hardware.
+// Boot with CPUS=1 so that both processes share one CPU.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+static uint
+rdtsc(void)
+{
+  uint lo, hi;
+
+  asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+  return lo;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n, i, pid, ping[2], pong[2];
+  uint t0, t1, ticks;
+  char c;
+
+  n = 10000;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(pipe(ping) < 0 || pipe(pong) < 0){
+    printf(2, "ctxbench: pipe failed\n");
+    exit();
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf(2, "ctxbench: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    for(i = 0; i < n; i++){
+      if(read(ping[0], &c, 1) != 1)
+        break;
+      write(pong[1], &c, 1);
+    }
+    exit();
+  }
+
+  c = 'x';
+  ticks = uptime();
+  t0 = rdtsc();
+  for(i = 0; i < n; i++){
+    write(ping[1], &c, 1);
+    if(read(pong[0], &c, 1) != 1){
+      printf(2, "ctxbench: read failed\n");
+      break;
+    }
+  }
+  t1 = rdtsc();
+  ticks = uptime() - ticks;
+  wait();
+
+  printf(1, "ctxbench: %d round trips in %d ticks, %d cycles each\n",
+         i, ticks, i ? (t1 - t0) / i : 0);
+  exit();
+}
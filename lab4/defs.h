@@ -2,19 +2,31 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct pcidev;
 struct pipe;
 struct proc;
+struct pseg;
+struct vma;
 struct rtcdate;
 struct spinlock;
 struct sleeplock;
+struct shm;
 struct stat;
 struct superblock;
+struct swapstat;
+struct tlbbatch;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bprefetch(uint, uint);
+struct buf*     bnew(uint, uint);
+void            bawrite(struct buf*);
+void            bwait(uint, uint);
+void            diskrw(struct buf*);
+void            bdone(struct buf*);
 
 // console.c
 void            consoleinit(void);
@@ -33,6 +45,7 @@ void            fileinit(void);
 int             fileread(struct file*, char*, int n);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
+int             filewriteback(struct file*, char*, uint, int);
 
 // fs.c
 void            readsb(int dev, struct superblock *sb);
@@ -50,8 +63,18 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, char*, uint, uint);
+uint            readahead(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
+int             writeibulk(struct inode*, char*, uint);
+
+// fpu.c
+void            fpuinit(void);
+void            fpufork(struct proc*, struct proc*);
+void            fpureset(struct proc*);
+void            fpuswitchin(struct proc*);
+void            fpuswitchout(struct proc*);
+void            fputrap(void);
 
 // ide.c
 void            ideinit(void);
@@ -64,19 +87,31 @@ extern uchar    ioapicid;
 void            ioapicinit(void);
 
 // kalloc.c
+extern uint     phystop;
 char*           kalloc(void);
+char*           kalloc_zeroed(void);
+char*           kallocbig(void);
+void            kfreebig(char*);
+void            kzeroidle(void);
 void            kfree(char*);
+int             kfreecount(void);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+void            kref(char*);
+int             krefcount(char*);
 
 // kbd.c
 void            kbdintr(void);
 
 // lapic.c
+uint            cmosmemkb(void);
 void            cmostime(struct rtcdate *r);
 int             lapicid(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
+void            ipiinit(void);
+void            ipicall(uint, void(*)(void*), void*);
+void            ipiintr(void);
 void            lapicinit(void);
 void            lapicstartap(uchar, uint);
 void            microdelay(int);
@@ -86,11 +121,30 @@ void            initlog(int dev);
 void            log_write(struct buf*);
 void            begin_op();
 void            end_op();
+void            log_sync(void);
+void            log_freed(uint);
+int             log_bypass(uint);
+
+// mmap.c
+uint            mmap(uint, uint, int, int, struct file*, uint);
+struct vma*     vmacreate(struct proc*, uint, uint, int, int);
+int             munmap(uint, uint);
+struct vma*     vmalookup(struct proc*, uint);
+int             vmafault(struct proc*, struct vma*, uint, int);
+int             vmadup(struct proc*, struct proc*);
+void            vmaclear(struct proc*);
 
 // mp.c
 extern int      ismp;
 void            mpinit(void);
 
+// pci.c
+void            pciinit(void);
+struct pcidev*  pcifind(ushort, ushort, uchar, uchar);
+void            pcienable(struct pcidev*);
+uint            pciread(struct pcidev*, uint);
+void            pciwrite(struct pcidev*, uint, uint);
+
 // picirq.c
 void            picenable(int);
 void            picinit(void);
@@ -101,6 +155,23 @@ void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
 int             pipewrite(struct pipe*, char*, int);
 
+// pcache.c
+void            pcinit(void);
+char*           pcget(struct inode*, uint, int);
+char*           pclookup(struct inode*, uint);
+void            pcinval(struct inode*);
+void            pcshare(struct inode*, uint, char*);
+int             pcunmap(struct inode*, uint, char*, int);
+void            pcwrite(struct inode*, char*, uint, uint);
+
+// shm.c
+void            shminit(void);
+uint            shm_open(char*, uint, uint);
+int             shm_close(uint);
+void            shmdup(struct shm*);
+void            shmput(struct shm*);
+char*           shmpage(struct shm*, uint);
+
 //PAGEBREAK: 16
 // proc.c
 int             cpuid(void);
@@ -112,11 +183,21 @@ struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
 void            procdump(void);
+int             clone(uint, uint, uint);
+int             join(uint*);
+int             leavevm(struct proc*);
+void            threadsync(struct proc*);
+int             pin(struct proc*, uint, uint);
+int             unmapbegin(struct proc*, uint, uint);
+void            unmapdone(void);
+extern struct sleeplock vmlock;
+int             swappick(char**, uint*, int);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+void            kproc(char*, void (*)(void));
 int             wait(void);
 void            wakeup(void*);
 void            yield(void);
@@ -154,9 +235,20 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// swap.c
+void            swapinit(void);
+char*           swapalloc(void);
+int             swapin(struct proc*, uint, pte_t);
+int             swapout(int);
+int             swapslot(void);
+void            swapdup(uint);
+void            swapfree(uint);
+void            swapstat(struct swapstat*);
+
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argoutptr(int, char**, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
@@ -176,8 +268,16 @@ void            uartinit(void);
 void            uartintr(void);
 void            uartputc(int);
 
+// virtio.c
+extern int      virtioirq;
+void            virtioinit(void);
+void            virtiointr(void);
+
 // vm.c
+extern pde_t*   kpgdir;
 void            seginit(void);
+pte_t*          walkpgdir(pde_t*, const void*, int);
+int             mappages(pde_t*, void*, uint, uint, int);
 void            kvmalloc(void);
 pde_t*          setupkvm(void);
 char*           uva2ka(pde_t*, char*);
@@ -191,6 +291,15 @@ void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
+int             uvmfault(struct proc*, uint, int);
+void            uvmmapcached(pde_t*, struct inode*, struct pseg*, int);
+int             uvmclock(struct proc*, uint, uint, uint*, char**, uint*, int);
+int             uvmmap(struct proc*, uint, char*, int, pte_t);
+extern struct spinlock uvmlock;
+void            tlbflush(pde_t*);
+void            tlbbatchinit(struct tlbbatch*, pde_t*);
+void            tlbbatchadd(struct tlbbatch*, char*, int);
+void            tlbbatchflush(struct tlbbatch*);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -0,0 +1,47 @@
+// Disk write benchmark.
+//
+// Writes a file of n KB (default 64) in 4KB chunks and reports
+// how long that took, up to the fsync() that gets it all on disk,
+// so the time is mostly disk time: compare "make qemu" (IDE) with
+// "make qemu-virtio".
+//    diskbench [n]
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+char buf[4096];
+
+int
+main(int argc, char *argv[])
+{
+  int fd, n, i, t0, t;
+
+  n = 64;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n <= 0)
+    n = 4;
+  n = (n + 3) / 4;
+
+  unlink("diskbench.tmp");
+  if((fd = open("diskbench.tmp", O_CREATE|O_RDWR)) < 0){
+    printf(2, "diskbench: cannot create file\n");
+    exit();
+  }
+  memset(buf, 'x', sizeof(buf));
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf(2, "diskbench: write failed after %d KB\n", i*4);
+      break;
+    }
+  }
+  fsync(fd);
+  t = uptime() - t0;
+  close(fd);
+  unlink("diskbench.tmp");
+  printf(1, "diskbench: %d KB in %d ticks\n", i*4, t);
+  exit();
+}
@@ -11,11 +11,12 @@ int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, npseg;
   uint argc, sz, sp, ustack[3+MAXARG+1];
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *oldexe;
   struct proghdr ph;
+  struct pseg pseg[NPSEG];
   pde_t *pgdir, *oldpgdir;
   struct proc *curproc = myproc();
 
@@ -38,8 +39,10 @@ exec(char *path, char **argv)
   if((pgdir = setupkvm()) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the loadable segments.  Nothing is read yet: uvmfault()
+  // pulls each page in from ip the first time it is touched.
   sz = 0;
+  npseg = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -49,32 +52,40 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr + ph.memsz >= MMAPBASE || ph.vaddr < sz)
       goto bad;
-    if(ph.vaddr % PGSIZE != 0)
-      goto bad;
-    if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(npseg >= NPSEG)
       goto bad;
+    pseg[npseg].va = ph.vaddr;
+    pseg[npseg].off = ph.off;
+    pseg[npseg].filesz = ph.filesz;
+    pseg[npseg].memsz = ph.memsz;
+    pseg[npseg].flags = ph.flags;
+    npseg++;
+    sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  // Text pages other processes already brought into the page
+  // cache can be mapped right away.
+  uvmmapcached(pgdir, ip, pseg, npseg);
+  // Keep a reference to ip for demand loading.
+  iunlock(ip);
   end_op();
-  ip = 0;
 
   // Allocate two pages at the next page boundary.
   // Make the first inaccessible.  Use the second as the user stack.
   sz = PGROUNDUP(sz);
   if((sz = allocuvm(pgdir, sz, sz + 2*PGSIZE)) == 0)
-    goto bad;
+    goto badstack;
   clearpteu(pgdir, (char*)(sz - 2*PGSIZE));
   sp = sz;
 
   // Push argument strings, prepare rest of stack in ustack.
   for(argc = 0; argv[argc]; argc++) {
     if(argc >= MAXARG)
-      goto bad;
+      goto badstack;
     sp = (sp - (strlen(argv[argc]) + 1)) & ~3;
     if(copyout(pgdir, sp, argv[argc], strlen(argv[argc]) + 1) < 0)
-      goto bad;
+      goto badstack;
     ustack[3+argc] = sp;
   }
   ustack[3+argc] = 0;
@@ -85,7 +96,7 @@ exec(char *path, char **argv)
 
   sp -= (3+argc+1) * 4;
   if(copyout(pgdir, sp, ustack, (3+argc+1)*4) < 0)
-    goto bad;
+    goto badstack;
 
   // Save program name for debugging.
   for(last=s=path; *s; s++)
@@ -93,14 +104,30 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(curproc->name, last, sizeof(curproc->name));
 
-  // Commit to the user image.
-  oldpgdir = curproc->pgdir;
+  // Commit to the user image.  The old address space goes
+  // away unless other threads still use it.
+  oldpgdir = 0;
+  if(!leavevm(curproc)){
+    vmaclear(curproc);
+    oldpgdir = curproc->pgdir;
+  }
+  oldexe = curproc->exe;
   curproc->pgdir = pgdir;
   curproc->sz = sz;
+  curproc->exe = ip;
+  memmove(curproc->pseg, pseg, sizeof(pseg));
+  curproc->npseg = npseg;
+  fpureset(curproc);
   curproc->tf->eip = elf.entry;  // main
   curproc->tf->esp = sp;
   switchuvm(curproc);
-  freevm(oldpgdir);
+  if(oldpgdir)
+    freevm(oldpgdir);
+  if(oldexe){
+    begin_op();
+    iput(oldexe);
+    end_op();
+  }
   return 0;
 
  bad:
@@ -111,4 +138,11 @@ exec(char *path, char **argv)
     end_op();
   }
   return -1;
+
+ badstack:
+  freevm(pgdir);
+  begin_op();
+  iput(ip);
+  end_op();
+  return -1;
 }
@@ -6,6 +6,7 @@
 #include "defs.h"
 #include "param.h"
 #include "fs.h"
+#include "stat.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
@@ -96,7 +97,7 @@ filestat(struct file *f, struct stat *st)
 int
 fileread(struct file *f, char *addr, int n)
 {
-  int r;
+  int r, seq;
 
   if(f->readable == 0)
     return -1;
@@ -104,8 +105,16 @@ fileread(struct file *f, char *addr, int n)
     return piperead(f->pipe, addr, n);
   if(f->type == FD_INODE){
     ilock(f->ip);
+    seq = f->off == f->rdoff;
     if((r = readi(f->ip, addr, f->off, n)) > 0)
       f->off += r;
+    // A read that continues where the last one ended starts the
+    // disk on the blocks that are likely to be read next.
+    if(seq)
+      f->raend = readahead(f->ip, f->off, f->raend);
+    else
+      f->raend = 0;
+    f->rdoff = f->off;
     iunlock(f->ip);
     return r;
   }
@@ -126,32 +135,80 @@ filewrite(struct file *f, char *addr, int n)
   if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
+    // i-node, a block for each level of indirection,
+    // allocation blocks,
     // and 2 blocks of slop for non-aligned writes.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
+    int max = ((MAXOPBLOCKS-1-NLEVEL-2) / 2) * 512;
+    // Whole blocks appended to a regular file go through
+    // writeibulk, NBULK at a time: their data bypasses the log,
+    // so only the metadata counts against the transaction.
     int i = 0;
     while(i < n){
       int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
+      int bulk;
 
       begin_op();
       ilock(f->ip);
-      if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
+      r = 0;
+      if(f->ip->type == T_FILE && f->off == f->ip->size &&
+         f->off % BSIZE == 0 && n1 >= BSIZE){
+        if(n1 > NBULK*BSIZE)
+          n1 = NBULK*BSIZE;
+        r = writeibulk(f->ip, addr + i, n1);
+      }
+      if(!(bulk = r > 0)){
+        if(n1 > max)
+          n1 = max;
+        r = writei(f->ip, addr + i, f->off, n1);
+      }
+      if(r > 0)
         f->off += r;
       iunlock(f->ip);
       end_op();
 
       if(r < 0)
         break;
-      if(r != n1)
-        panic("short filewrite");
       i += r;
+      if(!bulk && r != n1)
+        break;  // out of disk blocks
     }
     return i == n ? n : -1;
   }
   panic("filewrite");
 }
 
+// Write n bytes at addr back to offset off of f, without moving
+// f->off and without growing the file.  Used to write back dirty
+// pages of shared mappings.  Returns the number of bytes written.
+int
+filewriteback(struct file *f, char *addr, uint off, int n)
+{
+  int max = ((MAXOPBLOCKS-1-NLEVEL-2) / 2) * 512;
+  int i, n1, r;
+
+  if(f->type != FD_INODE)
+    return -1;
+  for(i = 0; i < n; i += r){
+    n1 = n - i;
+    if(n1 > max)
+      n1 = max;
+
+    begin_op();
+    ilock(f->ip);
+    r = 0;
+    if(off + i < f->ip->size){
+      if(n1 > f->ip->size - (off + i))
+        n1 = f->ip->size - (off + i);
+      r = writei(f->ip, addr + i, off + i, n1);
+    }
+    iunlock(f->ip);
+    end_op();
+
+    if(r <= 0)
+      break;
+  }
+  return i;
+}
+
@@ -6,6 +6,8 @@ struct file {
   struct pipe *pipe;
   struct inode *ip;
   uint off;
+  uint rdoff;    // where the last read ended, to spot sequential reads
+  uint raend;    // blocks before this one have been read ahead
 };
 
 
@@ -22,7 +24,7 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+NLEVEL];
 };
 
 // table mapping major device number to
@@ -0,0 +1,137 @@
+// File system fill test.
+//
+// Writes files until the disk is full, reads them all back to
+// check them, and removes them.  Run it on a large image made with
+// "make FSSIZE=n qemu" (n blocks of 512 bytes) to exercise block
+// numbers past the first few thousand, the bitmap blocks after the
+// first, and the kernel's handling of a full disk.  Each block
+// holds its file and block number, so a block written to the wrong
+// place shows up.  Files go NPERDIR to a directory, so that no
+// directory gets too long.  Stops after n files if given:
+//    fillfs [n]
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fs.h"
+#include "fcntl.h"
+
+#define NPERDIR 64
+#define CHUNK   (8*BSIZE)
+
+char buf[CHUNK];
+char want[BSIZE];
+
+// The name of file i, "fillD/F", and of its directory, "fillD".
+static char*
+path(int i, int dironly)
+{
+  static char p[32];
+  char digits[12];
+  int n, d;
+
+  strcpy(p, "fill");
+  n = 0;
+  d = i / NPERDIR;
+  do {
+    digits[n++] = '0' + d % 10;
+    d /= 10;
+  } while(d > 0);
+  for(d = 4; n > 0; d++)
+    p[d] = digits[--n];
+  if(!dironly){
+    p[d++] = '/';
+    p[d++] = 'a' + (i % NPERDIR) / 26;
+    p[d++] = 'a' + (i % NPERDIR) % 26;
+  }
+  p[d] = 0;
+  return p;
+}
+
+// The contents of block bn of file i.
+static void
+fill(char *b, int i, uint bn)
+{
+  memset(b, 'a' + (i + bn) % 26, BSIZE);
+  ((uint*)b)[0] = i;
+  ((uint*)b)[1] = bn;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, i, j, n, max, t0;
+  uint bn, kb;
+  struct stat st;
+
+  max = 0x7FFFFFFF;
+  if(argc > 1)
+    max = atoi(argv[1]);
+
+  // Write files until one gets no data at all: each file takes as
+  // much as the disk, or the largest file, will hold.
+  t0 = uptime();
+  kb = 0;
+  for(n = 0; n < max; n++){
+    if(n % NPERDIR == 0 && mkdir(path(n, 1)) < 0)
+      break;
+    if((fd = open(path(n, 0), O_CREATE|O_RDWR)) < 0)
+      break;
+    for(bn = 0; ; bn += CHUNK/BSIZE){
+      for(j = 0; j < CHUNK/BSIZE; j++)
+        fill(buf + j*BSIZE, n, bn + j);
+      if(write(fd, buf, CHUNK) != CHUNK)
+        break;
+    }
+    if(fstat(fd, &st) < 0){
+      printf(2, "fillfs: fstat failed\n");
+      exit();
+    }
+    close(fd);
+    if(st.size == 0){
+      unlink(path(n, 0));
+      break;
+    }
+    kb += st.size / 1024;
+    if(n % 256 == 0)
+      printf(1, "fillfs: %d files, %d KB\n", n, kb);
+  }
+  printf(1, "fillfs: wrote %d files, %d KB in %d ticks\n",
+         n, kb, uptime() - t0);
+
+  // Read them back.
+  for(i = 0; i < n; i++){
+    if((fd = open(path(i, 0), O_RDONLY)) < 0){
+      printf(2, "fillfs: cannot open %s\n", path(i, 0));
+      exit();
+    }
+    for(bn = 0; (j = read(fd, buf, CHUNK)) > 0; bn += CHUNK/BSIZE){
+      for(j = (j + BSIZE - 1) / BSIZE - 1; j >= 0; j--){
+        fill(want, i, bn + j);
+        if(memcmp(buf + j*BSIZE, want, BSIZE) != 0){
+          printf(2, "fillfs: %s block %d is wrong\n", path(i, 0), bn + j);
+          exit();
+        }
+      }
+    }
+    close(fd);
+  }
+  printf(1, "fillfs: read back ok\n");
+
+  // Remove them; the disk must work again afterwards.
+  for(i = 0; i < n; i++){
+    unlink(path(i, 0));
+    if(i % NPERDIR == NPERDIR - 1 || i == n - 1)
+      unlink(path(i, 1));
+  }
+  unlink(path(n, 1));  // in case the last file's directory is empty
+  if((fd = open("fillfs.tmp", O_CREATE|O_RDWR)) < 0 ||
+     write(fd, buf, CHUNK) != CHUNK){
+    printf(2, "fillfs: disk still full after removing files\n");
+    exit();
+  }
+  close(fd);
+  unlink("fillfs.tmp");
+  printf(1, "fillfs ok\n");
+  exit();
+}
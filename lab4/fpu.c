@@ -0,0 +1,112 @@
+// FPU and SSE state.
+//
+// The kernel never uses the FPU, so its registers only ever hold
+// some process's state.  Each process has an fxsave area in its
+// struct proc, and the registers are switched lazily:
+// * Before running a process the scheduler sets CR0_TS, unless the
+//     registers already hold that process's state.  The process's
+//     first FPU or SSE instruction then traps (T_DEVICE), and
+//     fputrap loads its state.
+// * When the process stops running, its state is saved only if it
+//     touched the FPU (CR0_TS is clear), since it may run on
+//     another CPU next.
+// A process that never uses the FPU costs nothing, and one that
+// keeps running on the same CPU never reloads its registers.
+//
+// cpu->fpu and proc->fpcpu together say whose state a CPU holds:
+// the registers of CPU c hold the latest state of p exactly when
+// c->fpu == p and p->fpcpu == c.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+
+#define MXCSR_DEFAULT 0x1F80  // all SSE exceptions masked
+
+// Turn on fxsave/fxrstor and SSE on this CPU, and make the
+// first FPU instruction trap.
+void
+fpuinit(void)
+{
+  lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+  lcr0((rcr0() & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS);
+  mycpu()->fpu = 0;
+}
+
+// Called by the scheduler just before it runs p.
+void
+fpuswitchin(struct proc *p)
+{
+  struct cpu *c = mycpu();
+
+  if(c->fpu == p && p->fpcpu == c)
+    clts();
+  else
+    lcr0(rcr0() | CR0_TS);
+}
+
+// Called by the scheduler when p stops running.
+void
+fpuswitchout(struct proc *p)
+{
+  if(rcr0() & CR0_TS)
+    return;
+  fxsave(p->fxarea);
+  lcr0(rcr0() | CR0_TS);
+}
+
+// Device-not-available trap: the current process used the FPU
+// while CR0_TS was set.  Load its state, or a clean state if this
+// is its first FPU instruction.  Whatever the registers held
+// before was saved when its owner stopped running.
+void
+fputrap(void)
+{
+  struct proc *p = myproc();
+  struct cpu *c;
+  uint mxcsr;
+
+  if(p == 0)
+    panic("fputrap");
+  clts();
+  c = mycpu();
+  if(c->fpu == p && p->fpcpu == c)
+    return;
+  if(p->fpused)
+    fxrstor(p->fxarea);
+  else {
+    asm volatile("fninit");
+    mxcsr = MXCSR_DEFAULT;
+    asm volatile("ldmxcsr %0" : : "m" (mxcsr));
+    p->fpused = 1;
+  }
+  c->fpu = p;
+  p->fpcpu = c;
+}
+
+// Give child np a copy of p's FPU state.  p is the current process.
+void
+fpufork(struct proc *np, struct proc *p)
+{
+  pushcli();
+  if((rcr0() & CR0_TS) == 0)
+    fxsave(p->fxarea);
+  popcli();
+  memmove(np->fxarea, p->fxarea, sizeof(np->fxarea));
+  np->fpused = p->fpused;
+  np->fpcpu = 0;
+}
+
+// Start the current process p over with a clean FPU (for exec).
+void
+fpureset(struct proc *p)
+{
+  pushcli();
+  p->fpused = 0;
+  p->fpcpu = 0;
+  lcr0(rcr0() | CR0_TS);
+  popcli();
+}
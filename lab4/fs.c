@@ -23,6 +23,7 @@
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
+static void bfree(int, uint);
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
@@ -52,15 +53,45 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Where bclaim starts to look for a free block: a hint that the
+// blocks before it are in use, so that on a large disk it need not
+// read the whole bitmap each time.  bfree moves it back.  It is
+// read and set without a lock: a racing update only makes a search
+// start in the wrong place, which wraps around to find any free
+// block, and the bitmap block's buffer lock keeps two allocations
+// from taking the same block.
+static uint brover;
+
+// Allocate a disk block, leaving its contents as they are:
+// block goal if it is free, else the next free one after goal
+// in goal's bitmap block, else the first free one from brover.
+// Returns 0 if the disk is full.
 static uint
-balloc(uint dev)
+bclaim(uint dev, uint goal)
 {
-  int b, bi, m;
+  uint b, bi, i, n, m;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
+  if(goal > 0 && goal < sb.size){
+    bp = bread(dev, BBLOCK(goal, sb));
+    b = goal - goal % BPB;
+    for(bi = goal % BPB; bi < BPB && b + bi < sb.size; bi++){
+      m = 1 << (bi % 8);
+      if((bp->data[bi/8] & m) == 0){
+        bp->data[bi/8] |= m;
+        log_write(bp);
+        brelse(bp);
+        return b + bi;
+      }
+    }
+    brelse(bp);
+  }
+
+  // Look at each bitmap block once, from brover's on.
+  n = (sb.size + BPB - 1) / BPB;
+  b = brover % (n * BPB);  // sb.size once the last block is taken
+  b -= b % BPB;
+  for(i = 0; i < n; i++, b = (b + BPB) % (n * BPB)){
     bp = bread(dev, BBLOCK(b, sb));
     for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
       m = 1 << (bi % 8);
@@ -68,13 +99,47 @@ balloc(uint dev)
         bp->data[bi/8] |= m;  // Mark block in use.
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
+        brover = b + bi + 1;
         return b + bi;
       }
     }
     brelse(bp);
   }
-  panic("balloc: out of blocks");
+  cprintf("balloc: out of blocks\n");
+  return 0;
+}
+
+// Allocate a zeroed disk block, goal if possible.
+// Returns 0 if the disk is full.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint b;
+
+  if((b = bclaim(dev, goal)) != 0)
+    bzero(dev, b);
+  return b;
+}
+
+// Allocate a block for file data that the caller will write in
+// place, bypassing the log (see log_bypass).  Blocks that may not
+// bypass it are handed back.  Returns 0 if no block was found.
+static uint
+ballocdata(uint dev, uint goal)
+{
+  uint b, skip[4];
+  int i, n;
+
+  b = 0;
+  for(n = 0; n < NELEM(skip); n++){
+    if((b = bclaim(dev, goal)) == 0 || log_bypass(b))
+      break;
+    skip[n] = b;
+    b = 0;
+  }
+  for(i = 0; i < n; i++)
+    bfree(dev, skip[i]);
+  return b;
 }
 
 // Free a disk block.
@@ -92,6 +157,9 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  log_freed(b);
+  if(b < brover)
+    brover = b;
 }
 
 // Inodes.
@@ -179,26 +247,36 @@ iinit(int dev)
   }
 
   readsb(dev, &sb);
+  if(sb.size == 0 || sb.bmapstart + (sb.size + BPB - 1) / BPB > sb.size)
+    panic("iinit: bad superblock");
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
- inodestart %d bmap start %d\n", sb.size, sb.nblocks,
+ inodestart %d bmap start %d%s\n", sb.size, sb.nblocks,
           sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
-          sb.bmapstart);
+          sb.bmapstart, (sb.flags & FS_EXTENT) ? " extents" : "");
 }
 
 static struct inode* iget(uint dev, uint inum);
 
 //PAGEBREAK!
+// Where ialloc starts to look for a free inode, a hint that the
+// inodes before it are in use.  iput moves it back.  Like brover,
+// it is only a hint and is read and set without a lock.
+static uint irover = 1;
+
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
-// Returns an unlocked but allocated and referenced inode.
+// Returns an unlocked but allocated and referenced inode,
+// or 0 if there are no free inodes.
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
+  uint i, inum;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
+  // Look at inodes 1 .. sb.ninodes-1 once, from irover on.
+  for(i = 0; i < sb.ninodes - 1; i++){
+    inum = 1 + (irover - 1 + i) % (sb.ninodes - 1);
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
@@ -206,11 +284,13 @@ ialloc(uint dev, short type)
       dip->type = type;
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
+      irover = inum + 1;
       return iget(dev, inum);
     }
     brelse(bp);
   }
-  panic("ialloc: no inodes");
+  cprintf("ialloc: no inodes\n");
+  return 0;
 }
 
 // Copy a modified in-memory inode to disk.
@@ -342,6 +422,8 @@ iput(struct inode *ip)
       ip->type = 0;
       iupdate(ip);
       ip->valid = 0;
+      if(ip->inum < irover)
+        irover = ip->inum;
     }
   }
   releasesleep(&ip->lock);
@@ -365,38 +447,246 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT], the next NINDIRECT^2
+// in the blocks listed in ip->addrs[NDIRECT+1], and the next
+// NINDIRECT^3 one level further down from ip->addrs[NDIRECT+2].
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// Allocate a data block, goal if possible: zeroed and logged,
+// or, if inplace, for the caller to write in place (ballocdata).
 static uint
-bmap(struct inode *ip, uint bn)
+bdata(uint dev, int inplace, uint goal)
+{
+  return inplace ? ballocdata(dev, goal) : balloc(dev, goal);
+}
+
+// Where a file with no blocks yet starts looking for free ones:
+// one of NEXTGROUP places spread over the data blocks, chosen by
+// inode number.  Files written at the same time then grow in
+// different places, instead of taking turns at the first free
+// block and cutting each other's extents into single blocks.
+static uint
+egoal(struct inode *ip)
 {
-  uint addr, *a;
+  return sb.size - sb.nblocks + (ip->inum % NEXTGROUP) * (sb.nblocks / NEXTGROUP);
+}
+
+// bmap1 for a file system of extent-mapped inodes.  Files have
+// no holes, so the block to allocate is always the one after the
+// last, which extends the last extent if the disk block after it
+// is free.  When the extents in the inode and in its extent
+// blocks are all used, emap chains on another extent block.
+// Returns 0 if the disk is full.
+static uint
+emap(struct inode *ip, uint bn, int inplace)
+{
+  struct extent *e, *last;
+  struct buf *bp, *nbp;
+  uint base, addr, eb, *link;
+  int i, n;
+
+  // Search the extents in the inode, then those in the chain
+  // of extent blocks.  bp holds the block e is in, if any.
+  bp = 0;
+  e = (struct extent*)ip->addrs;
+  n = NEXTENT;
+  link = &ip->addrs[EXTBLK];
+  base = 0;
+  for(;;){
+    for(i = 0; i < n && e[i].len; i++){
+      if(bn < base + e[i].len){
+        addr = e[i].start + bn - base;
+        goto out;
+      }
+      base += e[i].len;
+    }
+    if(i < n || *link == 0)
+      break;
+    nbp = bread(ip->dev, *link);
+    if(bp)
+      brelse(bp);
+    bp = nbp;
+    e = (struct extent*)bp->data;
+    n = NEXTENTBLK;
+    link = &e[NEXTENTBLK].start;
+  }
+  if(bn != base)
+    panic("emap: hole");
+
+  // Extent blocks are only chained on with an extent in them,
+  // so if e has any, the last of the file's is e[i-1].
+  last = i > 0 ? &e[i-1] : 0;
+  if((addr = bdata(ip->dev, inplace, last ? last->start + last->len : egoal(ip))) == 0)
+    goto out;
+  if(last && addr == last->start + last->len){
+    last->len++;
+  } else if(i < n){
+    e[i].start = addr;
+    e[i].len = 1;
+  } else {
+    // Chain on a new extent block.
+    if((eb = balloc(ip->dev, 0)) == 0){
+      bfree(ip->dev, addr);
+      addr = 0;
+      goto out;
+    }
+    *link = eb;
+    nbp = bread(ip->dev, eb);
+    e = (struct extent*)nbp->data;
+    e[0].start = addr;
+    e[0].len = 1;
+    log_write(nbp);
+    brelse(nbp);
+  }
+  if(bp)
+    log_write(bp);
+
+out:
+  if(bp)
+    brelse(bp);
+  return addr;
+}
+
+// bmap, but a data block it allocates is one for writing in place
+// if inplace is set.  Returns 0 if it could not allocate a block.
+static uint
+bmap1(struct inode *ip, uint bn, int inplace)
+{
+  uint addr, *a, span, level, i;
   struct buf *bp;
 
+  if(sb.flags & FS_EXTENT)
+    return emap(ip, bn, inplace);
+
   if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+    if((addr = ip->addrs[bn]) == 0 && (addr = bdata(ip->dev, inplace, 0)) != 0)
+      ip->addrs[bn] = addr;
     return addr;
   }
   bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+  // Find how many levels of indirect blocks lead to bn, and
+  // the number of blocks (span) under the top one.
+  level = 1;
+  span = NINDIRECT;
+  while(bn >= span){
+    bn -= span;
+    if(++level > NLEVEL)
+      panic("bmap: out of range");
+    span *= NINDIRECT;
+  }
+
+  // Load the top indirect block, allocating if necessary.
+  if((addr = ip->addrs[NDIRECT+level-1]) == 0){
+    if((addr = balloc(ip->dev, 0)) == 0)
+      return 0;
+    ip->addrs[NDIRECT+level-1] = addr;
+  }
+  // Walk down, allocating as necessary.
+  for(; level > 0; level--){
+    span /= NINDIRECT;
+    i = bn / span;
+    bn %= span;
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
+    if((addr = a[i]) == 0){
+      addr = level > 1 ? balloc(ip->dev, 0) : bdata(ip->dev, inplace, 0);
+      if(addr != 0){
+        a[i] = addr;
+        log_write(bp);
+      }
     }
     brelse(bp);
-    return addr;
+    if(addr == 0)
+      return 0;
+  }
+  return addr;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one, or returns 0
+// if the disk is full.
+static uint
+bmap(struct inode *ip, uint bn)
+{
+  return bmap1(ip, bn, 0);
+}
+
+// Freeing the blocks of a large file changes more bitmap blocks
+// than one FS operation may log, so itrunc moves on to a new
+// operation after each TRUNCBM of them.  That is safe because the
+// inode is unreachable: a crash part way leaves it allocated, with
+// nothing referring to it.
+#define TRUNCBM (MAXOPBLOCKS/2)
+
+struct trunc {
+  uint dev;
+  uint bmblock;  // bitmap block of the last block freed
+  int nbm;       // bitmap blocks changed in this operation
+};
+
+static void
+tfree(struct trunc *t, uint b)
+{
+  if(BBLOCK(b, sb) != t->bmblock){
+    if(t->nbm == TRUNCBM){
+      end_op();
+      begin_op();
+      t->nbm = 0;
+    }
+    t->nbm++;
+    t->bmblock = BBLOCK(b, sb);
   }
+  bfree(t->dev, b);
+}
 
-  panic("bmap: out of range");
+// Free block b and, if it is an indirect block of level levels,
+// the blocks below it.  Rereads b for each entry rather than
+// hold it across tfree's end_op.
+static void
+tfreeind(struct trunc *t, uint b, int level)
+{
+  struct buf *bp;
+  uint addr;
+  int j;
+
+  for(j = 0; level > 0 && j < NINDIRECT; j++){
+    bp = bread(t->dev, b);
+    addr = ((uint*)bp->data)[j];
+    brelse(bp);
+    if(addr)
+      tfreeind(t, addr, level - 1);
+  }
+  tfree(t, b);
+}
+
+// Free the blocks of the extents at e[0..n-1], and if eb is
+// not 0, those of the chain of extent blocks from eb and the
+// extent blocks themselves.  Like tfreeind, rereads each extent
+// block rather than hold it across tfree's end_op.
+static void
+tfreeext(struct trunc *t, struct extent *e, int n, uint eb)
+{
+  struct buf *bp;
+  struct extent x;
+  uint j, next;
+  int i;
+
+  for(i = 0; i < n; i++)
+    for(j = 0; j < e[i].len; j++)
+      tfree(t, e[i].start + j);
+  for(; eb; eb = next){
+    for(i = 0; i <= NEXTENTBLK; i++){
+      bp = bread(t->dev, eb);
+      x = ((struct extent*)bp->data)[i];
+      brelse(bp);
+      if(i == NEXTENTBLK)
+        next = x.start;
+      else
+        for(j = 0; j < x.len; j++)
+          tfree(t, x.start + j);
+    }
+    tfree(t, eb);
+  }
 }
 
 // Truncate inode (discard contents).
@@ -404,30 +694,28 @@ bmap(struct inode *ip, uint bn)
 // to it (no directory entries referring to it)
 // and has no in-memory reference to it (is
 // not an open file or current directory).
+// Caller must be in an FS operation, which itrunc may
+// end and replace by a new one.
 static void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
-
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
-  }
-
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  struct trunc t;
+  int i;
+
+  t.dev = ip->dev;
+  t.bmblock = 0;
+  t.nbm = 0;
+  pcinval(ip);
+  if(sb.flags & FS_EXTENT){
+    tfreeext(&t, (struct extent*)ip->addrs, NEXTENT, ip->addrs[EXTBLK]);
+    memset(ip->addrs, 0, sizeof(ip->addrs));
+  } else {
+    for(i = 0; i < NDIRECT+NLEVEL; i++){
+      if(ip->addrs[i]){
+        tfreeind(&t, ip->addrs[i], i < NDIRECT ? 0 : i - NDIRECT + 1);
+        ip->addrs[i] = 0;
+      }
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
 
   ip->size = 0;
@@ -475,13 +763,35 @@ readi(struct inode *ip, char *dst, uint off, uint n)
   return n;
 }
 
+// Start reading the NREADAHEAD blocks of ip from offset off on
+// into the buffer cache, without waiting for them, skipping those
+// before block raend, which were started earlier.  Returns the
+// block after the last one started.  Caller must hold ip->lock.
+uint
+readahead(struct inode *ip, uint off, uint raend)
+{
+  uint bn, end;
+
+  if(ip->type == T_DEV)
+    return 0;
+  bn = off/BSIZE;
+  end = bn + NREADAHEAD;
+  if(end > (ip->size + BSIZE - 1)/BSIZE)
+    end = (ip->size + BSIZE - 1)/BSIZE;
+  if(bn < raend)
+    bn = raend;
+  for(; bn < end; bn++)
+    bprefetch(ip->dev, bmap(ip, bn));
+  return bn > raend ? bn : raend;
+}
+
 // PAGEBREAK!
 // Write data to inode.
 // Caller must hold ip->lock.
 int
 writei(struct inode *ip, char *src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
   struct buf *bp;
 
   if(ip->type == T_DEV){
@@ -496,18 +806,62 @@ writei(struct inode *ip, char *src, uint off, uint n)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    if((addr = bmap(ip, off/BSIZE)) == 0)
+      break;  // out of disk blocks
+    bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(bp->data + off%BSIZE, src, m);
     log_write(bp);
     brelse(bp);
   }
 
-  if(n > 0 && off > ip->size){
+  // Keep the page cache, and so shared mappings, coherent.
+  if(ip->type == T_FILE)
+    pcwrite(ip, src - tot, off - tot, tot);
+
+  if(off > ip->size){
     ip->size = off;
     iupdate(ip);
   }
-  return n;
+  return tot;
+}
+
+// Append n bytes to ip, whose size is a multiple of BSIZE, writing
+// the new data blocks in place rather than through the log: only
+// the inode, bitmap and indirect blocks go in the log, and the
+// committer waits for the data before it commits them.  Returns
+// the number of bytes written, which is short (perhaps 0) when a
+// block may not bypass the log.  Caller must hold ip->lock.
+int
+writeibulk(struct inode *ip, char *src, uint n)
+{
+  uint tot, m, off, addr;
+  struct buf *bp;
+
+  off = ip->size;
+  if(ip->type != T_FILE || off % BSIZE || off + n < off)
+    return -1;
+  if(off + n > MAXFILE*BSIZE)
+    return -1;
+
+  for(tot=0; tot<n; tot+=m, off+=m, src+=m){
+    if((addr = bmap1(ip, off/BSIZE, 1)) == 0)
+      break;
+    bp = bnew(ip->dev, addr);
+    m = min(n - tot, BSIZE);
+    memmove(bp->data, src, m);
+    memset(bp->data + m, 0, BSIZE - m);
+    bawrite(bp);
+  }
+
+  if(tot > 0){
+    // Keep the page cache, and so shared mappings, coherent.
+    pcwrite(ip, src - tot, ip->size, tot);
+    ip->size = off;
+  }
+  // bmap1 may have added an indirect block even if tot is 0.
+  iupdate(ip);
+  return tot;
 }
 
 //PAGEBREAK!
@@ -572,7 +926,7 @@ dirlink(struct inode *dp, char *name, uint inum)
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-    panic("dirlink");
+    return -1;  // out of disk blocks
 
   return 0;
 }
@@ -19,11 +19,36 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint swapstart;    // Block number of first swap block
+  uint nswap;        // Number of swap blocks
+  uint flags;        // FS_*
 };
 
-#define NDIRECT 12
+#define FS_EXTENT 1  // inodes map their blocks by extent (mkfs -e)
+
+// Blocks of swap space after the file system (NSWAPPG pages)
+#define NSWAPBLK (NSWAPPG*(4096/BSIZE))
+
+#define NDIRECT 10
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NLEVEL 3  // single, double and triple indirect blocks
+#define MAXFILE (NDIRECT + NINDIRECT + NINDIRECT*NINDIRECT + \
+                 NINDIRECT*NINDIRECT*NINDIRECT)
+
+// A run of len disk blocks from start.  On a file system with
+// FS_EXTENT set, an inode's addrs hold NEXTENT of them, which
+// map its blocks in order, and then the address of the first of
+// a chain of extent blocks.  Each holds NEXTENTBLK more extents
+// and, in the start of its last slot, the address of the next
+// block of the chain, or 0.  Unused extents have len 0.
+struct extent {
+  uint start;
+  uint len;
+};
+#define NEXTENT ((NDIRECT+NLEVEL-1) / 2)
+#define EXTBLK (NDIRECT+NLEVEL-1)  // addrs[EXTBLK] is the extent block
+#define NEXTENTBLK (BSIZE / sizeof(struct extent) - 1)
+#define NEXTGROUP 16  // parts of the disk new files start in
 
 // On-disk inode structure
 struct dinode {
@@ -32,7 +57,7 @@ struct dinode {
   short minor;          // Minor device number (T_DEV only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NDIRECT+NLEVEL];   // Data block addresses
 };
 
 // Inodes per block.
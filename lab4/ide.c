@@ -1,4 +1,6 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// IDE driver code.  Transfers use bus master DMA when the PCI
+// IDE controller supports it, and programmed I/O otherwise.
+// Sectors past the 28-bit limit (128GB) use the LBA48 commands.
 
 #include "types.h"
 #include "defs.h"
@@ -12,6 +14,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "pci.h"
 
 #define SECTOR_SIZE   512
 #define IDE_BSY       0x80
@@ -23,16 +26,78 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_SETMUL 0xc6
+#define IDE_CMD_RDDMA 0xc8
+#define IDE_CMD_WRDMA 0xca
+#define IDE_CMD_READ_EXT  0x24  // LBA48 versions
+#define IDE_CMD_WRITE_EXT 0x34
+#define IDE_CMD_RDMUL_EXT 0x29
+#define IDE_CMD_WRMUL_EXT 0x39
+#define IDE_CMD_RDDMA_EXT 0x25
+#define IDE_CMD_WRDMA_EXT 0x35
+#define IDE_CMD_IDENTIFY  0xec
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
-// You must hold idelock while manipulating queue.
+// Commands by addressing (LBA28, LBA48), transfer (PIO a sector
+// per interrupt, PIO multiple, DMA) and direction (read, write).
+static uchar idecmd[2][3][2] = {
+  { { IDE_CMD_READ, IDE_CMD_WRITE },
+    { IDE_CMD_RDMUL, IDE_CMD_WRMUL },
+    { IDE_CMD_RDDMA, IDE_CMD_WRDMA } },
+  { { IDE_CMD_READ_EXT, IDE_CMD_WRITE_EXT },
+    { IDE_CMD_RDMUL_EXT, IDE_CMD_WRMUL_EXT },
+    { IDE_CMD_RDDMA_EXT, IDE_CMD_WRDMA_EXT } },
+};
+
+// Bus master registers of the primary channel, from BAR4.
+#define BM_CMD        0
+  #define BM_START      0x01
+  #define BM_READ       0x08  // transfer to memory
+#define BM_STATUS     2
+  #define BM_ERR        0x02
+  #define BM_INTR       0x04
+#define BM_PRDT       4     // physical address of the PRD table
+
+#define IDE_MAXSECT   256  // sectors per command
+#define IDE_MULT      16   // sectors per interrupt for READ/WRITE MULTIPLE
+
+// idequeue holds the bufs waiting for the disk, in elevator order:
+// up from idepos, where the last command ended, to the end of the
+// disk, then up from the start (C-SCAN).  So a request is served
+// within one sweep of the disk, however busy it is.
+// A command covers a run of adjacent blocks from the head of the
+// queue, up to IDE_MAXSECT sectors.  Its bufs are on ideactive,
+// linked through qnext.
+// You must hold idelock while manipulating the queue.
 
 static struct spinlock idelock;
 static struct buf *idequeue;
+static struct buf *ideactive;
+static uint idepos;
+
+// Data transfer of the active command.
+static struct buf *idexbuf;  // next buf to transfer to or from
+static uint idexoff;         // and the offset in its data
+static uint idexleft;        // sectors not transferred yet
 
 static int havedisk1;
-static void idestart(struct buf*);
+static int idemult[2];       // sectors per interrupt, for each drive
+static uint idesize[2];      // sectors on each drive
+static int idelba48[2];      // drive supports LBA48
+
+// Physical region descriptor: a piece of memory the controller
+// moves data to or from.  One command takes a table of them, which
+// must not cross a 64KB boundary.
+struct prd {
+  uint addr;
+  ushort len;                // bytes; 0 means 64KB
+  ushort flags;
+};
+#define PRD_EOT 0x8000       // last entry of the table
+
+static uint idebm;           // bus master I/O base, or 0 for PIO
+static struct prd prdt[2*IDE_MAXSECT/(BSIZE/SECTOR_SIZE)]
+  __attribute__((aligned(4096)));
+static void idestart(void);
 
 // Wait for IDE disk to become ready.
 static int
@@ -47,9 +112,48 @@ idewait(int checkerr)
   return 0;
 }
 
+// Have drive transfer IDE_MULT sectors per interrupt, if it can.
+static void
+idesetmult(int drive)
+{
+  outb(0x3f6, 2);  // no interrupt
+  outb(0x1f6, 0xe0 | (drive<<4));
+  idewait(0);
+  outb(0x1f2, IDE_MULT);
+  outb(0x1f7, IDE_CMD_SETMUL);
+  idemult[drive] = idewait(1) < 0 ? 1 : IDE_MULT;
+}
+
+// Ask drive for its size and whether it supports LBA48.
+static void
+ideidentify(int drive)
+{
+  ushort id[SECTOR_SIZE/2];
+
+  outb(0x3f6, 2);  // no interrupt
+  outb(0x1f6, 0xe0 | (drive<<4));
+  idewait(0);
+  outb(0x1f7, IDE_CMD_IDENTIFY);
+  if(idewait(1) < 0){
+    idesize[drive] = 0xFFFFFFFF;  // don't know; don't check
+    return;
+  }
+  insl(0x1f0, id, SECTOR_SIZE/4);
+  idesize[drive] = id[60] | (id[61] << 16);
+  if(id[83] & (1<<10)){
+    idelba48[drive] = 1;
+    // Sector numbers are 32 bits here; use the first 2TB.
+    if(id[102] || id[103])
+      idesize[drive] = 0xFFFFFFFF;
+    else
+      idesize[drive] = id[100] | (id[101] << 16);
+  }
+}
+
 void
 ideinit(void)
 {
+  struct pcidev *d;
   int i;
 
   initlock(&idelock, "ide");
@@ -65,67 +169,187 @@ ideinit(void)
     }
   }
 
+  ideidentify(0);
+  idesetmult(0);
+  bdevsw[0].rw = iderw;
+  if(havedisk1){
+    ideidentify(1);
+    idesetmult(1);
+    bdevsw[1].rw = iderw;
+  }
+
+  // Use DMA if the controller is a bus master (prog if bit 7).
+  d = pcifind(0, 0, PCI_CLASS_STORAGE, PCI_SUB_IDE);
+  if(d && (d->progif & 0x80) && d->baseio[4]){
+    pcienable(d);
+    idebm = d->bar[4];
+  }
+
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Move n sectors between the disk and the active bufs.
 static void
-idestart(struct buf *b)
+idepio(uint n)
 {
-  if(b == 0)
+  int write;
+
+  write = ideactive->flags & B_DIRTY;
+  for(; n > 0; n--){
+    if(write)
+      outsl(0x1f0, idexbuf->data + idexoff, SECTOR_SIZE/4);
+    else
+      insl(0x1f0, idexbuf->data + idexoff, SECTOR_SIZE/4);
+    idexleft--;
+    idexoff += SECTOR_SIZE;
+    if(idexoff == BSIZE){
+      idexbuf = idexbuf->qnext;
+      idexoff = 0;
+    }
+  }
+}
+
+static uint
+min(uint a, uint b)
+{
+  return a < b ? a : b;
+}
+
+// Point the controller at the data of the bufs from b on.
+// A buf's data is physically contiguous, but may cross a 64KB
+// boundary, which one descriptor cannot.
+static void
+idedmaprep(struct buf *b, int write)
+{
+  uint pa, len, m;
+  int n;
+
+  n = 0;
+  for(; b; b = b->qnext){
+    pa = V2P(b->data);
+    for(len = BSIZE; len > 0; len -= m, pa += m){
+      m = min(len, 0x10000 - (pa & 0xFFFF));
+      prdt[n].addr = pa;
+      prdt[n].len = m;
+      prdt[n].flags = 0;
+      n++;
+    }
+  }
+  prdt[n-1].flags = PRD_EOT;
+  outl(idebm + BM_PRDT, V2P(prdt));
+  outb(idebm + BM_CMD, write ? 0 : BM_READ);
+  outb(idebm + BM_STATUS, BM_ERR|BM_INTR);  // clear
+}
+
+// Start a command for the run of adjacent blocks at the head of
+// idequeue.  Caller must hold idelock.
+static void
+idestart(void)
+{
+  struct buf *b, *last;
+  int sector_per_block =  BSIZE/SECTOR_SIZE;
+  int n, drive, write, lba48;
+  uint sector;
+
+  if((b = idequeue) == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
+  write = b->flags & B_DIRTY;
+  n = sector_per_block;
+  for(last = b; last->qnext; last = last->qnext){
+    if(last->qnext->dev != b->dev ||
+       last->qnext->blockno != last->blockno + 1 ||
+       (last->qnext->flags & B_DIRTY) != write ||
+       n + sector_per_block > IDE_MAXSECT)
+      break;
+    n += sector_per_block;
+  }
+  drive = b->dev & 1;
+  if(last->blockno >= idesize[drive] / sector_per_block)
     panic("incorrect blockno");
-  int sector_per_block =  BSIZE/SECTOR_SIZE;
-  int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+  idequeue = last->qnext;
+  last->qnext = 0;
+  ideactive = b;
+  idepos = last->blockno + 1;
 
-  if (sector_per_block > 7) panic("idestart");
+  sector = b->blockno * sector_per_block;
+  lba48 = sector + n > (1<<28);
+  if(lba48 && !idelba48[drive])
+    panic("idestart: no LBA48");
+  idexbuf = b;
+  idexoff = 0;
+  idexleft = n;
 
   idewait(0);
+  if(idebm)
+    idedmaprep(b, write);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  if(lba48){
+    // The registers take the high bytes first.
+    outb(0x1f2, n >> 8);
+    outb(0x1f3, sector >> 24);
+    outb(0x1f4, 0);
+    outb(0x1f5, 0);
+  }
+  outb(0x1f2, n & 0xff);  // number of sectors; 0 means 256
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
-  outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
-  if(b->flags & B_DIRTY){
-    outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
-  } else {
-    outb(0x1f7, read_cmd);
-  }
+  if(lba48)
+    outb(0x1f6, 0xe0 | (drive<<4));
+  else
+    outb(0x1f6, 0xe0 | (drive<<4) | ((sector>>24)&0x0f));
+  outb(0x1f7, idecmd[lba48][idebm ? 2 : idemult[drive] > 1][write != 0]);
+  if(idebm)
+    outb(idebm + BM_CMD, (write ? 0 : BM_READ) | BM_START);
+  else if(write)
+    idepio(min(idemult[drive], idexleft));
 }
 
 // Interrupt handler.
 void
 ideintr(void)
 {
-  struct buf *b;
+  struct buf *b, *next;
 
-  // First queued buffer is the active request.
   acquire(&idelock);
 
-  if((b = idequeue) == 0){
+  if(ideactive == 0){
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  if(idebm){
+    // The whole transfer is done; stop the DMA engine.
+    outb(idebm + BM_CMD, 0);
+    outb(idebm + BM_STATUS, BM_ERR|BM_INTR);
+    idewait(1);
+  } else if(idexleft > 0 && idewait(1) >= 0){
+    // Each interrupt but the last asks for the next sectors.
+    idepio(min(idemult[ideactive->dev & 1], idexleft));
+    if(idexleft > 0 || (ideactive->flags & B_DIRTY)){
+      release(&idelock);
+      return;
+    }
+  }
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // The command is done (or failed): wake the processes waiting
+  // for its bufs, or release them if nobody is waiting.
+  for(b = ideactive; b; b = next){
+    next = b->qnext;
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->flags & B_ASYNC){
+      b->flags &= ~B_ASYNC;
+      bdone(b);
+    } else
+      wakeup(b);
+  }
+  ideactive = 0;
 
-  // Start disk on next buf in queue.
+  // Start disk on next bufs in queue.
   if(idequeue != 0)
-    idestart(idequeue);
+    idestart();
 
   release(&idelock);
 }
@@ -134,6 +358,8 @@ ideintr(void)
 // Sync buf with disk.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
+// If B_ASYNC is set, only queue the request: ideintr releases
+// the buf with bdone when it is done.
 void
 iderw(struct buf *b)
 {
@@ -148,15 +374,22 @@ iderw(struct buf *b)
 
   acquire(&idelock);  //DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
+  // Insert b in elevator order.  Subtracting idepos puts the
+  // blocks behind it last.
   for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
+    if(b->blockno - idepos < (*pp)->blockno - idepos)
+      break;
+  b->qnext = *pp;
   *pp = b;
 
   // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  if(ideactive == 0)
+    idestart();
+
+  if(b->flags & B_ASYNC){
+    release(&idelock);
+    return;
+  }
 
   // Wait for request to finish.
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
@@ -21,8 +21,19 @@ struct {
   struct spinlock lock;
   int use_lock;
   struct run *freelist;
+  struct run *bigfree;  // free 4MB-aligned chunks of SPGSIZE bytes
+  struct run *zerolist; // free pages already zeroed by kzeroidle
+  int nzero;            // pages on zerolist
+  int nfree;            // free pages, counting those in chunks
+  // Number of page tables (plus the page cache) holding each
+  // physical page.  A page goes back on the free list when its
+  // count drops to zero.  kinit1 puts the array just past the
+  // kernel, sized for phystop.
+  ushort *ref;
 } kmem;
 
+uint phystop;  // Top physical memory
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
@@ -31,8 +42,23 @@ struct {
 void
 kinit1(void *vstart, void *vend)
 {
+  uint kb;
+
   initlock(&kmem.lock, "kmem");
   kmem.use_lock = 0;
+
+  // Use all the memory there is, up to what fits in the
+  // kernel's direct map between KERNBASE and DEVSPACE.
+  kb = cmosmemkb();
+  if(kb > PHYSLIMIT/1024)
+    kb = PHYSLIMIT/1024;
+  phystop = PGROUNDDOWN(kb*1024);
+  if(phystop < V2P(vend))
+    panic("kinit1: not enough memory");
+
+  kmem.ref = (ushort*)vstart;
+  memset(kmem.ref, 0, phystop/PGSIZE * sizeof(kmem.ref[0]));
+  vstart = kmem.ref + phystop/PGSIZE;
   freerange(vstart, vend);
 }
 
@@ -48,8 +74,15 @@ freerange(void *vstart, void *vend)
 {
   char *p;
   p = (char*)PGROUNDUP((uint)vstart);
-  for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)vend; p += PGSIZE){
+    // Keep whole 4MB chunks together for kallocbig.
+    if((uint)p % SPGSIZE == 0 && p + SPGSIZE <= (char*)vend){
+      kfreebig(p);
+      p += SPGSIZE - PGSIZE;
+      continue;
+    }
     kfree(p);
+  }
 }
 //PAGEBREAK: 21
 // Free the page of physical memory pointed at by v,
@@ -61,17 +94,33 @@ kfree(char *v)
 {
   struct run *r;
 
-  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+  if((uint)v % PGSIZE || v < end || V2P(v) >= phystop)
     panic("kfree");
 
+  // Only the last reference really frees a shared page.
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  if(kmem.ref[V2P(v)/PGSIZE] > 1){
+    kmem.ref[V2P(v)/PGSIZE]--;
+    if(kmem.use_lock)
+      release(&kmem.lock);
+    return;
+  }
+  kmem.ref[V2P(v)/PGSIZE] = 0;
+#ifdef KJUNK
+  if(kmem.use_lock)
+    release(&kmem.lock);
+
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
 
   if(kmem.use_lock)
     acquire(&kmem.lock);
+#endif
   r = (struct run*)v;
   r->next = kmem.freelist;
   kmem.freelist = r;
+  kmem.nfree++;
   if(kmem.use_lock)
     release(&kmem.lock);
 }
@@ -83,14 +132,178 @@ char*
 kalloc(void)
 {
   struct run *r;
+  char *p;
 
   if(kmem.use_lock)
     acquire(&kmem.lock);
+  if(kmem.freelist == 0 && kmem.zerolist){
+    kmem.freelist = kmem.zerolist;
+    kmem.zerolist = 0;
+    kmem.nzero = 0;
+  }
+  if(kmem.freelist == 0 && kmem.bigfree){
+    // Break up a chunk.
+    p = (char*)kmem.bigfree;
+    kmem.bigfree = kmem.bigfree->next;
+    for(r = (struct run*)(p + SPGSIZE); r != (struct run*)p; ){
+      r = (struct run*)((char*)r - PGSIZE);
+      r->next = kmem.freelist;
+      kmem.freelist = r;
+    }
+  }
   r = kmem.freelist;
-  if(r)
+  if(r){
     kmem.freelist = r->next;
+    kmem.ref[V2P(r)/PGSIZE] = 1;
+    kmem.nfree--;
+  }
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  return (char*)r;
+}
+
+// Allocate one page filled with zeros.  Takes a page that an
+// idle CPU already cleared (see kzeroidle) when there is one, so
+// that the caller does not have to.
+// Returns 0 if the memory cannot be allocated.
+char*
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  r = kmem.zerolist;
+  if(r){
+    kmem.zerolist = r->next;
+    kmem.nzero--;
+    kmem.nfree--;
+    kmem.ref[V2P(r)/PGSIZE] = 1;
+  }
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  if(r){
+    r->next = 0;  // the only word the free list dirtied
+    return (char*)r;
+  }
+
+  if((r = (struct run*)kalloc()) != 0)
+    memset(r, 0, PGSIZE);
+  return (char*)r;
+}
+
+// Zero one free page and move it to the pool of zeroed pages,
+// unless the pool is full.  The scheduler calls this when the
+// CPU has nothing else to do.
+void
+kzeroidle(void)
+{
+  struct run *r;
+
+  if(!kmem.use_lock)
+    return;
+  acquire(&kmem.lock);
+  if(kmem.nzero >= NZEROPG || (r = kmem.freelist) == 0){
+    release(&kmem.lock);
+    return;
+  }
+  kmem.freelist = r->next;
+  release(&kmem.lock);
+
+  memset(r, 0, PGSIZE);
+
+  acquire(&kmem.lock);
+  r->next = kmem.zerolist;
+  kmem.zerolist = r;
+  kmem.nzero++;
+  release(&kmem.lock);
+}
+
+// Add a reference to the page at v, which must have come from
+// kalloc().  Each reference is dropped with a call to kfree().
+void
+kref(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= phystop)
+    panic("kref");
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  if(kmem.ref[V2P(v)/PGSIZE] == 0 || kmem.ref[V2P(v)/PGSIZE] == 0xFFFF)
+    panic("kref: bad count");
+  kmem.ref[V2P(v)/PGSIZE]++;
+  if(kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// Return the number of references to the page at v.
+int
+krefcount(char *v)
+{
+  int n;
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  n = kmem.ref[V2P(v)/PGSIZE];
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  return n;
+}
+
+// Return the number of free pages.
+int
+kfreecount(void)
+{
+  return kmem.nfree;
+}
+
+// Allocate a 4MB-aligned chunk of SPGSIZE bytes for a superpage.
+// Returns 0 if there is no whole chunk left.  Each page in the
+// chunk has one reference, so the chunk can later be split and
+// its pages freed one by one with kfree().
+char*
+kallocbig(void)
+{
+  struct run *r;
+  uint i;
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  r = kmem.bigfree;
+  if(r){
+    kmem.bigfree = r->next;
+    for(i = 0; i < NPTENTRIES; i++)
+      kmem.ref[V2P(r)/PGSIZE + i] = 1;
+    kmem.nfree -= NPTENTRIES;
+  }
   if(kmem.use_lock)
     release(&kmem.lock);
   return (char*)r;
 }
 
+// Free a chunk returned by kallocbig().
+void
+kfreebig(char *v)
+{
+  struct run *r;
+  uint i;
+
+  if((uint)v % SPGSIZE || v < end || V2P(v) + SPGSIZE > phystop)
+    panic("kfreebig");
+
+#ifdef KJUNK
+  // Fill with junk to catch dangling refs.
+  memset(v, 1, SPGSIZE);
+#endif
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  for(i = 0; i < NPTENTRIES; i++)
+    kmem.ref[V2P(v)/PGSIZE + i] = 0;
+  r = (struct run*)v;
+  r->next = kmem.bigfree;
+  kmem.bigfree = r;
+  kmem.nfree += NPTENTRIES;
+  if(kmem.use_lock)
+    release(&kmem.lock);
+}
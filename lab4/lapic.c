@@ -9,6 +9,9 @@
 #include "traps.h"
 #include "mmu.h"
 #include "x86.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
 
 // Local APIC registers, divided by 4 for use as uint[] indices.
 #define ID      (0x0020/4)   // ID
@@ -160,10 +163,66 @@ lapicstartap(uchar apicid, uint addr)
   }
 }
 
+// Cross-CPU function calls.  ipicall(mask, fn, arg) interrupts
+// each CPU whose bit (by index in cpus[]) is set in mask with T_IPI,
+// has it run fn(arg) in its interrupt handler, and waits until all
+// of them have.  One call is in flight at a time.  The caller must
+// be able to sleep and must not hold a spinlock, since the other
+// CPUs only take the interrupt with interrupts enabled.
+struct {
+  struct sleeplock lock;
+  void (*fn)(void*);
+  void *arg;
+  volatile uint pending;   // CPUs that have not run fn yet
+} ipi;
+
+void
+ipiinit(void)
+{
+  initsleeplock(&ipi.lock, "ipi");
+}
+
+void
+ipicall(uint mask, void (*fn)(void*), void *arg)
+{
+  int i;
+
+  if(mask == 0)
+    return;
+  acquiresleep(&ipi.lock);
+  ipi.fn = fn;
+  ipi.arg = arg;
+  ipi.pending = mask;
+  pushcli();  // stay on this CPU's local APIC
+  for(i = 0; i < ncpu; i++){
+    if(!(mask & (1 << i)))
+      continue;
+    lapicw(ICRHI, cpus[i].apicid << 24);
+    lapicw(ICRLO, FIXED | T_IPI);
+    while(lapic[ICRLO] & DELIVS)
+      ;
+  }
+  popcli();
+  while(ipi.pending)
+    ;
+  releasesleep(&ipi.lock);
+}
+
+// Interrupt handler for ipicall.
+void
+ipiintr(void)
+{
+  ipi.fn(ipi.arg);
+  __sync_fetch_and_and(&ipi.pending, ~(1 << cpuid()));
+}
+
 #define CMOS_STATA   0x0a
 #define CMOS_STATB   0x0b
 #define CMOS_UIP    (1 << 7)        // RTC update in progress
 
+#define EXTLO   0x30    // KB of memory from 1MB to 65MB
+#define EXTHI   0x34    // 64KB blocks of memory above 16MB
+
 #define SECS    0x00
 #define MINS    0x02
 #define HOURS   0x04
@@ -180,6 +239,21 @@ cmos_read(uint reg)
   return inb(CMOS_RETURN);
 }
 
+// Return the size of physical memory in KB.
+uint
+cmosmemkb(void)
+{
+  uint n;
+
+  // The BIOS (and qemu) leave the amount of memory above 16MB
+  // in EXTHI; EXTLO can only describe the first 64MB or so.
+  n = cmos_read(EXTHI) | (cmos_read(EXTHI+1) << 8);
+  if(n)
+    return 16*1024 + n*64;
+  n = cmos_read(EXTLO) | (cmos_read(EXTLO+1) << 8);
+  return 1024 + n;
+}
+
 static void
 fill_rtcdate(struct rtcdate *r)
 {
@@ -18,7 +18,28 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the transaction is handed to the committer.
+//
+// Commits are done by a kernel process, the committer, so
+// end_op() does not wait for the disk (group commit).  When the
+// last outstanding operation ends, the committer moves the open
+// transaction's header to its own (the headers are double
+// buffered) and copies the modified blocks into the log's buffers.
+// From then on new system calls can start the next transaction
+// while the committer writes the log, the header, and the blocks'
+// home locations.  The next transaction commits after this one.
+// Processes that need their updates on disk call log_sync()
+// (the fsync system call).
+//
+// Installing must not write a newer, uncommitted version of a block
+// that the open transaction has modified since the copy; those are
+// written from their copy in the log instead.
+//
+// Data blocks appended to files can bypass the log (see log_bypass
+// and writeibulk): they are written in place, once, and the
+// committer waits for them before it writes the header, so the
+// metadata that points at them never commits before they are on
+// disk.  The size of the log comes from the superblock (mkfs -l).
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -27,7 +48,6 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -36,19 +56,37 @@ struct logheader {
   int block[LOGSIZE];
 };
 
+// Blocks of a transaction that are not in its log: the data blocks
+// written in place, which must be on disk before the transaction
+// commits, and the blocks freed, which must not be written in place
+// until it has committed, since until then they may still hold
+// the data of their old owner.
+struct ordered {
+  int n;
+  int block[NBYPASS];
+  int nfreed;           // -1 if there were too many to list
+  int freed[NBYPASS];
+};
+
 struct log {
   struct spinlock lock;
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int committing;  // committer is copying blocks, please wait.
   int dev;
-  struct logheader lh;
+  struct logheader lh;  // the open transaction
+  struct logheader clh; // the one being committed
+  struct ordered ord;   // and their other blocks
+  struct ordered cord;
+  uint seq;        // transactions handed to the committer so far
+  uint done;       // and of those, the ones committed
+  struct buf buf;  // for writes outside the buffer cache
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void committer(void);
 
 void
 initlog(int dev)
@@ -58,55 +96,92 @@ initlog(int dev)
 
   struct superblock sb;
   initlock(&log.lock, "log");
+  initsleeplock(&log.buf.lock, "logbuf");
   readsb(dev, &sb);
   log.start = sb.logstart;
   log.size = sb.nlog;
+  if(log.size > LOGSIZE + 1)
+    log.size = LOGSIZE + 1;
+  if(log.size < MAXOPBLOCKS + 1)
+    panic("initlog: log too small");
   log.dev = dev;
   recover_from_log();
+  kproc("logcommit", committer);
+}
+
+// Is block in the transaction of header lh?
+// Caller must hold log.lock.
+static int
+inlog(struct logheader *lh, int block)
+{
+  int i;
+
+  for (i = 0; i < lh->n; i++)
+    if (lh->block[i] == block)
+      return 1;
+  return 0;
 }
 
 // Copy committed blocks from log to their home location
 static void
-install_trans(void)
+install_trans(struct logheader *lh)
 {
-  int tail;
+  int tail, newer;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
+  for (tail = 0; tail < lh->n; tail++) {
     struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
+    struct buf *dbuf = bread(log.dev, lh->block[tail]); // read dst
+    acquire(&log.lock);
+    newer = inlog(&log.lh, lh->block[tail]);
+    release(&log.lock);
+    if (!newer) {
+      memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+      bawrite(dbuf);  // start writing dst to disk
+    } else {
+      // The open transaction has changed dst since: write the
+      // committed copy, bypassing the cache.
+      acquiresleep(&log.buf.lock);
+      log.buf.dev = log.dev;
+      log.buf.blockno = lh->block[tail];
+      log.buf.flags = B_DIRTY;
+      memmove(log.buf.data, lbuf->data, BSIZE);
+      diskrw(&log.buf);
+      releasesleep(&log.buf.lock);
+      brelse(dbuf);
+    }
     brelse(lbuf);
-    brelse(dbuf);
   }
+  // Queued together, adjacent blocks go out in one command.
+  for (tail = 0; tail < lh->n; tail++)
+    bwait(log.dev, lh->block[tail]);
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the log header from disk into the committer's header
 static void
 read_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  log.clh.n = lh->n;
+  for (i = 0; i < log.clh.n; i++) {
+    log.clh.block[i] = lh->block[i];
   }
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
+// Write log header lh to disk.
 // This is the true point at which the
-// current transaction commits.
+// transaction commits.
 static void
-write_head(void)
+write_head(struct logheader *lh)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = lh->n;
+  for (i = 0; i < lh->n; i++) {
+    hb->block[i] = lh->block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -116,9 +191,9 @@ static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  install_trans(&log.clh); // if committed, copy from log to disk
+  log.clh.n = 0;
+  write_head(&log.clh); // clear the log
 }
 
 // called at the start of each FS system call.
@@ -129,7 +204,7 @@ begin_op(void)
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > log.size-1){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
@@ -141,19 +216,17 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// hands the transaction to the committer if this was the
+// last outstanding operation.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
   if(log.committing)
     panic("log.committing");
   if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+    wakeup(&log.clh);
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
@@ -161,49 +234,90 @@ end_op(void)
     wakeup(&log);
   }
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Wait until the updates of all FS system calls that have
+// ended are on disk.
+void
+log_sync(void)
+{
+  uint seq;
+
+  acquire(&log.lock);
+  // An empty open transaction has nothing to wait for.
+  seq = log.lh.n > 0 ? log.seq + 1 : log.seq;
+  while(log.done < seq){
+    wakeup(&log.clh);
+    sleep(&log.done, &log.lock);
   }
+  release(&log.lock);
 }
 
-// Copy modified blocks from cache to log.
+// Copy the blocks of the transaction being committed into the
+// log's buffers, and start writing them to the log.
 static void
 write_log(void)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
+  for (tail = 0; tail < log.clh.n; tail++) {
+    struct buf *to = bnew(log.dev, log.start+tail+1); // log block
+    struct buf *from = bread(log.dev, log.clh.block[tail]); // cache block
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    bawrite(to);  // start writing the log
     brelse(from);
-    brelse(to);
   }
 }
 
+// The committer: commits each transaction once no system call
+// is adding to it any more.
 static void
-commit()
+committer(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
+  int tail;
+
+  for(;;){
+    acquire(&log.lock);
+    while(log.lh.n == 0 || log.outstanding > 0)
+      sleep(&log.clh, &log.lock);
+    log.clh = log.lh;
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    log.cord = log.ord;
+    log.ord.n = 0;
+    log.ord.nfreed = 0;
+    log.seq++;
+    log.committing = 1;
+    release(&log.lock);
+
+    write_log();     // Copy modified blocks from cache to log
+
+    // The next transaction can start now.
+    acquire(&log.lock);
+    log.committing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    for (tail = 0; tail < log.clh.n; tail++)
+      bwait(log.dev, log.start+tail+1);
+    for (tail = 0; tail < log.cord.n; tail++)
+      bwait(log.dev, log.cord.block[tail]);  // data written in place
+    write_head(&log.clh);    // Write header to disk -- the real commit
+    install_trans(&log.clh); // Now install writes to home locations
+    log.clh.n = 0;
+    write_head(&log.clh);    // Erase the transaction from the log
+
+    acquire(&log.lock);
+    log.cord.n = 0;
+    log.cord.nfreed = 0;
+    log.done = log.seq;
+    wakeup(&log.done);
+    release(&log.lock);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache with B_DIRTY.
-// commit()/write_log() will do the disk write.
+// The committer will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -232,3 +346,53 @@ log_write(struct buf *b)
   release(&log.lock);
 }
 
+
+// Block b of the open transaction has been freed.
+void
+log_freed(uint b)
+{
+  acquire(&log.lock);
+  if(log.ord.nfreed >= 0){
+    if(log.ord.nfreed < NBYPASS)
+      log.ord.freed[log.ord.nfreed++] = b;
+    else
+      log.ord.nfreed = -1;
+  }
+  release(&log.lock);
+}
+
+static int
+infreed(struct ordered *o, uint b)
+{
+  int i;
+
+  if(o->nfreed < 0)
+    return 1;
+  for(i = 0; i < o->nfreed; i++)
+    if(o->freed[i] == b)
+      return 1;
+  return 0;
+}
+
+// Ask to write data block b, just allocated, in place instead of
+// through the log.  Returns 1 if the caller may, and should then
+// start the write (bawrite) before its end_op(); 0 if b must not
+// bypass the log: if a logged copy of it could be installed over
+// the new data, or it was freed by a transaction that has not
+// committed, or the transaction has too many such blocks.
+int
+log_bypass(uint b)
+{
+  int ok;
+
+  if (log.outstanding < 1)
+    panic("log_bypass outside of trans");
+  acquire(&log.lock);
+  ok = log.ord.n < NBYPASS &&
+       !inlog(&log.lh, b) && !inlog(&log.clh, b) &&
+       !infreed(&log.ord, b) && !infreed(&log.cord, b);
+  if(ok)
+    log.ord.block[log.ord.n++] = b;
+  release(&log.lock);
+  return ok;
+}
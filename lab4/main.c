@@ -21,6 +21,7 @@ main(void)
   kvmalloc();      // kernel page table
   mpinit();        // detect other processors
   lapicinit();     // interrupt controller
+  ipiinit();       // cross-CPU calls
   seginit();       // segment descriptors
   picinit();       // disable pic
   ioapicinit();    // another interrupt controller
@@ -28,11 +29,16 @@ main(void)
   uartinit();      // serial port
   pinit();         // process table
   tvinit();        // trap vectors
-  binit();         // buffer cache
+  pcinit();        // page cache
+  shminit();       // shared memory segments
+  swapinit();      // swap space
   fileinit();      // file table
+  pciinit();       // PCI devices
   ideinit();       // disk 
+  virtioinit();    // virtio disk, if any, for the file system
   startothers();   // start other processors
-  kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
+  kinit2(P2V(4*1024*1024), P2V(phystop)); // must come after startothers()
+  binit();         // buffer cache, sized from free memory
   userinit();      // first user process
   mpmain();        // finish this processor's setup
 }
@@ -53,6 +59,7 @@ mpmain(void)
 {
   cprintf("cpu%d: starting %d\n", cpuid(), cpuid());
   idtinit();       // load idt register
+  fpuinit();       // FPU and SSE
   xchg(&(mycpu()->started), 1); // tell startothers() we're up
   scheduler();     // start running processes
 }
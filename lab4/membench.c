@@ -0,0 +1,120 @@
+// Memory routine benchmark.
+//
+// Times memmove, memset and memcmp from ulib against plain byte
+// loops, for several sizes and source/destination alignments, and
+// prints the cost of each in cycles per KB.
+//    membench
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define MAXSZ (64*1024)
+#define NELEM(x) (sizeof(x)/sizeof((x)[0]))
+
+static char src[MAXSZ+64], dst[MAXSZ+64];
+
+static uint
+rdtsc(void)
+{
+  uint lo, hi;
+
+  asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+  return lo;
+}
+
+static void
+bytemove(char *d, const char *s, int n)
+{
+  while(n-- > 0)
+    *d++ = *s++;
+}
+
+static void
+byteset(char *d, int c, int n)
+{
+  while(n-- > 0)
+    *d++ = c;
+}
+
+static int
+bytecmp(const char *a, const char *b, int n)
+{
+  while(n-- > 0)
+    if(*a++ != *b++)
+      return 1;
+  return 0;
+}
+
+// Cycles per KB for iters runs of an operation on n bytes.
+static uint
+perkb(uint t0, uint t1, int n, int iters)
+{
+  return (t1 - t0) / (n / 64 * iters / 16);
+}
+
+static void
+run(int n, int doff, int soff)
+{
+  char *d = dst + doff, *s = src + soff;
+  int i, iters;
+  uint t0, t1, mv, bmv, st, bst, cm, bcm;
+
+  iters = (4*1024*1024) / n;
+
+  t0 = rdtsc();
+  for(i = 0; i < iters; i++)
+    memmove(d, s, n);
+  t1 = rdtsc();
+  mv = perkb(t0, t1, n, iters);
+  t0 = rdtsc();
+  for(i = 0; i < iters; i++)
+    bytemove(d, s, n);
+  t1 = rdtsc();
+  bmv = perkb(t0, t1, n, iters);
+
+  t0 = rdtsc();
+  for(i = 0; i < iters; i++)
+    memset(d, i, n);
+  t1 = rdtsc();
+  st = perkb(t0, t1, n, iters);
+  t0 = rdtsc();
+  for(i = 0; i < iters; i++)
+    byteset(d, i, n);
+  t1 = rdtsc();
+  bst = perkb(t0, t1, n, iters);
+
+  memmove(d, s, n);
+  t0 = rdtsc();
+  for(i = 0; i < iters; i++)
+    if(memcmp(d, s, n) != 0)
+      printf(1, "membench: memcmp wrong\n");
+  t1 = rdtsc();
+  cm = perkb(t0, t1, n, iters);
+  t0 = rdtsc();
+  for(i = 0; i < iters; i++)
+    if(bytecmp(d, s, n) != 0)
+      printf(1, "membench: bytecmp wrong\n");
+  t1 = rdtsc();
+  bcm = perkb(t0, t1, n, iters);
+
+  printf(1, "%d\t%d/%d\t%d\t%d\t%d\t%d\t%d\t%d\n",
+         n, doff, soff, mv, bmv, st, bst, cm, bcm);
+}
+
+int
+main(int argc, char *argv[])
+{
+  static int sizes[] = { 64, 512, 4096, MAXSZ };
+  static int offs[][2] = { {0, 0}, {1, 1}, {0, 3} };
+  int i, j;
+
+  for(i = 0; i < sizeof(src); i++)
+    src[i] = i;
+  printf(1, "cycles per KB: ulib routine vs byte loop\n");
+  printf(1, "size\tdst/src\tmemmove\tbytes\tmemset\tbytes\tmemcmp\tbytes\n");
+  for(i = 0; i < NELEM(sizes); i++)
+    for(j = 0; j < NELEM(offs); j++)
+      run(sizes[i], offs[j][0], offs[j][1]);
+  exit();
+}
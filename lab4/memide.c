@@ -13,7 +13,7 @@
 #include "fs.h"
 #include "buf.h"
 
-extern uchar _binary_fs_img_start[], _binary_fs_img_size[];
+extern uchar _binary_fsmem_img_start[], _binary_fsmem_img_size[];
 
 static int disksize;
 static uchar *memdisk;
@@ -21,8 +21,9 @@ static uchar *memdisk;
 void
 ideinit(void)
 {
-  memdisk = _binary_fs_img_start;
-  disksize = (uint)_binary_fs_img_size/BSIZE;
+  memdisk = _binary_fsmem_img_start;
+  disksize = (uint)_binary_fsmem_img_size/BSIZE;
+  bdevsw[1].rw = iderw;
 }
 
 // Interrupt handler.
@@ -57,4 +58,8 @@ iderw(struct buf *b)
   } else
     memmove(b->data, p, BSIZE);
   b->flags |= B_VALID;
+  if(b->flags & B_ASYNC){
+    b->flags &= ~B_ASYNC;
+    bdone(b);
+  }
 }
@@ -15,14 +15,20 @@
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
-#define NINODES 200
+#define NINODES 200     // inodes of a small file system
+#define BLKPERINODE 64  // and of a large one, one per this many blocks
+#define FSMAX (0x7FFFFFFF - NSWAPBLK)  // block numbers are ints here and there
 
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
 
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+uint fssize = FSSIZE;  // see -s
+uint fsflags;          // see -e
+uint nswap = NSWAPBLK;  // see -w
+int ninodes;
+int nbitmap;
+int ninodeblocks;
+int nlog = LOGSIZE + 1;  // header and data blocks; see -l
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -76,11 +82,45 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  // -l n: make the log n blocks long, header included.
+  // -s n: make the file system n blocks long.
+  // -e: map the blocks of files by extent (FS_EXTENT).
+  // -w n: lay out n pages of swap space after it (0 for none).
+  while(argc > 2 && argv[1][0] == '-'){
+    if(strcmp(argv[1], "-e") == 0){
+      fsflags |= FS_EXTENT;
+      argv++;
+      argc--;
+      continue;
+    }
+    if(strcmp(argv[1], "-l") == 0)
+      nlog = atoi(argv[2]);
+    else if(strcmp(argv[1], "-s") == 0)
+      fssize = strtoul(argv[2], 0, 0);
+    else if(strcmp(argv[1], "-w") == 0)
+      nswap = strtoul(argv[2], 0, 0) * (4096/BSIZE);
+    else
+      break;
+    argv += 2;
+    argc -= 2;
+  }
+  if(argc < 2 || nlog < MAXOPBLOCKS + 1 || nlog > LOGSIZE + 1 ||
+     fssize > FSMAX || nswap > NSWAPBLK){
+    fprintf(stderr, "Usage: mkfs [-e] [-l nlog] [-s size] [-w swappages] fs.img files...\n");
+    fprintf(stderr, "  %d <= nlog <= %d, size <= %d\n",
+            MAXOPBLOCKS + 1, LOGSIZE + 1, FSMAX);
     exit(1);
   }
 
+  // Inode numbers must fit in a dirent.
+  ninodes = fssize / BLKPERINODE;
+  if(ninodes < NINODES)
+    ninodes = NINODES;
+  if(ninodes > 0xFFFF)
+    ninodes = 0xFFFF;
+  ninodeblocks = ninodes / IPB + 1;
+  nbitmap = fssize/BPB + 1;
+
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
 
@@ -92,23 +132,35 @@ main(int argc, char *argv[])
 
   // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  nblocks = fssize - nmeta;
+  if(nblocks < 2*nmeta){
+    fprintf(stderr, "mkfs: %u blocks is too small\n", fssize);
+    exit(1);
+  }
 
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.swapstart = xint(fssize);
+  sb.nswap = xint(nswap);
+  sb.flags = xint(fsflags);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %u\n",
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
+  // The image starts out all zeroes, without writing them: the
+  // blocks past its end read as zeroes, and a large image stays
+  // sparse on the host.  The swap area need not be cleared either.
+  if(ftruncate(fsfd, (off_t)(fssize + nswap) * BSIZE) < 0){
+    perror("ftruncate");
+    exit(1);
+  }
 
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
@@ -170,7 +222,7 @@ main(int argc, char *argv[])
 void
 wsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
+  if(lseek(fsfd, (off_t)sec * BSIZE, 0) != (off_t)sec * BSIZE){
     perror("lseek");
     exit(1);
   }
@@ -210,7 +262,7 @@ rinode(uint inum, struct dinode *ip)
 void
 rsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
+  if(lseek(fsfd, (off_t)sec * BSIZE, 0) != (off_t)sec * BSIZE){
     perror("lseek");
     exit(1);
   }
@@ -238,20 +290,95 @@ void
 balloc(int used)
 {
   uchar buf[BSIZE];
-  int i;
+  int i, b;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  assert(used < fssize);
+  for(b = 0; b < used; b += BPB){
+    bzero(buf, BSIZE);
+    for(i = 0; i < BPB && b + i < used; i++){
+      buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    }
+    printf("balloc: write bitmap block at sector %d\n", sb.bmapstart + b/BPB);
+    wsect(sb.bmapstart + b/BPB, buf);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// bmap for an extent-mapped inode, like emap in fs.c.  Blocks
+// are allocated in order, so a file's blocks are usually one
+// extent; a directory gets one for each block.
+uint
+emap(struct dinode *din, uint fbn)
+{
+  struct extent *e;
+  uint base;
+  int i;
+
+  e = (struct extent*)din->addrs;
+  base = 0;
+  for(i = 0; i < NEXTENT && xint(e[i].len); i++){
+    if(fbn < base + xint(e[i].len))
+      return xint(e[i].start) + fbn - base;
+    base += xint(e[i].len);
+  }
+  assert(fbn == base);
+  if(i > 0 && xint(e[i-1].start) + xint(e[i-1].len) == freeblock){
+    e[i-1].len = xint(xint(e[i-1].len) + 1);
+  } else {
+    assert(i < NEXTENT);
+    e[i].start = xint(freeblock);
+    e[i].len = xint(1);
+  }
+  return freeblock++;
+}
+
+// Return the address of block fbn of din, allocating it and the
+// indirect blocks that lead to it as needed, like bmap in fs.c.
+uint
+bmap(struct dinode *din, uint fbn)
+{
+  uint level, span, i, x;
+  uint indirect[NINDIRECT];
+
+  if(fsflags & FS_EXTENT)
+    return emap(din, fbn);
+
+  if(fbn < NDIRECT){
+    if(xint(din->addrs[fbn]) == 0){
+      din->addrs[fbn] = xint(freeblock++);
+    }
+    return xint(din->addrs[fbn]);
+  }
+  fbn -= NDIRECT;
+
+  level = 1;
+  span = NINDIRECT;
+  while(fbn >= span){
+    fbn -= span;
+    level++;
+    span *= NINDIRECT;
+    assert(level <= NLEVEL);
+  }
+  if(xint(din->addrs[NDIRECT+level-1]) == 0){
+    din->addrs[NDIRECT+level-1] = xint(freeblock++);
+  }
+  x = xint(din->addrs[NDIRECT+level-1]);
+  for(; level > 0; level--){
+    span /= NINDIRECT;
+    i = fbn / span;
+    fbn %= span;
+    rsect(x, (char*)indirect);
+    if(indirect[i] == 0){
+      indirect[i] = xint(freeblock++);
+      wsect(x, (char*)indirect);
+    }
+    x = xint(indirect[i]);
+  }
+  return x;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -259,7 +386,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -268,22 +394,7 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = bmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
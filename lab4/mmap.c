@@ -0,0 +1,422 @@
+// Memory mappings.
+//
+// mmap() maps files or anonymous memory into the region between
+// MMAPBASE and KERNBASE.  Each mapping is a struct vma in the
+// process, and its pages are filled in on first touch by vmafault():
+// * MAP_SHARED file mappings map the file's pages straight from the
+//     page cache, so mappers see each other's stores and write()s
+//     to the file; a fault fails if the page cannot be cached.
+//     Stores reach the file when the last shared mapping of a page
+//     goes away (munmap(), exit(), exec()), not before.
+// * MAP_PRIVATE file mappings get a private copy of each page, or
+//     the cached page itself if the mapping is read-only.
+// * Anonymous private mappings are zero-filled on demand.
+//     Anonymous shared mappings are populated up front so that
+//     fork() can hand the very same pages to the child.
+// * Shared memory segments (see shm.c) map the segment's pages.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "x86.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "mman.h"
+
+// Return the mapping of p that contains va, or 0.
+struct vma*
+vmalookup(struct proc *p, uint va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->start && va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+static struct vma*
+vmaalloc(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->start == 0)
+      return v;
+  return 0;
+}
+
+// Does [start, end) overlap any mapping of p?
+static int
+vmaoverlap(struct proc *p, uint start, uint end)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->start && start < v->end && end > v->start)
+      return 1;
+  return 0;
+}
+
+// Find the lowest free range of len bytes above MMAPBASE.
+// Returns 0 if there is none.
+static uint
+vmaplace(struct proc *p, uint len)
+{
+  struct vma *v;
+  uint a;
+
+  a = MMAPBASE;
+  for(;;){
+    if(a + len > KERNBASE || a + len < a)
+      return 0;
+    for(v = p->vma; v < &p->vma[NVMA]; v++)
+      if(v->start && a < v->end && a + len > v->start)
+        break;
+    if(v == &p->vma[NVMA])
+      return a;
+    a = v->end;
+  }
+}
+
+static int
+vmaperm(struct vma *v)
+{
+  if(v->prot & PROT_WRITE)
+    return PTE_U|PTE_W;
+  return PTE_U;
+}
+
+// Remove the pages of [start, end) of v from p's page table,
+// writing back pages of shared file mappings that pcunmap says
+// are dirty.
+static void
+vmaunmap(struct proc *p, struct vma *v, uint start, uint end)
+{
+  pte_t *pte;
+  uint a, pa, off;
+  int shared;
+  struct tlbbatch b;
+
+  // Other threads may have the pages in their TLBs.
+  shared = krefcount((char*)p->pgdir) > 1;
+  tlbbatchinit(&b, p->pgdir);
+  for(a = start; a < end; a += PGSIZE){
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if(!pte){
+      a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
+    if((*pte & PTE_P) == 0)
+      continue;
+    pa = PTE_ADDR(*pte);
+    off = v->off + (a - v->start);
+    if(v->f && (v->flags & MAP_SHARED) &&
+       pcunmap(v->f->ip, off, P2V(pa), (*pte & PTE_D) != 0))
+      filewriteback(v->f, P2V(pa), off, PGSIZE);
+    *pte = 0;
+    if(shared)
+      tlbbatchadd(&b, P2V(pa), 0);
+    else
+      kfree(P2V(pa));
+  }
+  tlbbatchflush(&b);
+  if(p == myproc())
+    lcr3(V2P(p->pgdir));
+}
+
+// Record a new mapping of len bytes (a multiple of PGSIZE) in p,
+// at addr if it is non-zero, else wherever there is room.
+// Returns the mapping, or 0 if the range is unusable or p has no
+// free mapping slots.
+struct vma*
+vmacreate(struct proc *p, uint addr, uint len, int prot, int flags)
+{
+  struct vma *v;
+
+  if(addr){
+    if(addr % PGSIZE || addr < MMAPBASE || addr + len > KERNBASE ||
+       addr + len < addr || vmaoverlap(p, addr, addr + len))
+      return 0;
+  } else if((addr = vmaplace(p, len)) == 0)
+    return 0;
+  if((v = vmaalloc(p)) == 0)
+    return 0;
+
+  v->start = addr;
+  v->end = addr + len;
+  v->prot = prot;
+  v->flags = flags;
+  v->f = 0;
+  v->off = 0;
+  v->shm = 0;
+  return v;
+}
+
+// Drop the objects v refers to and free its slot.
+static void
+vmafree(struct vma *v)
+{
+  if(v->f)
+    fileclose(v->f);
+  if(v->shm)
+    shmput(v->shm);
+  v->f = 0;
+  v->shm = 0;
+  v->start = 0;
+}
+
+// Map len bytes of f starting at offset off (or anonymous memory
+// if flags has MAP_ANONYMOUS) into the current process, at addr
+// if it is non-zero.  Returns the address of the mapping, or -1.
+// Caller must hold vmlock.
+static uint
+mmap1(uint addr, uint len, int prot, int flags, struct file *f, uint off)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  char *mem;
+  uint a;
+
+  if(len == 0 || len > KERNBASE - MMAPBASE || off % PGSIZE)
+    return -1;
+  // Exactly one of MAP_SHARED and MAP_PRIVATE.
+  if(!(flags & MAP_SHARED) == !(flags & MAP_PRIVATE))
+    return -1;
+  if(flags & MAP_ANONYMOUS){
+    f = 0;
+    off = 0;
+  } else {
+    if(f == 0 || f->type != FD_INODE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  len = PGROUNDUP(len);
+  if((v = vmacreate(p, addr, len, prot, flags)) == 0)
+    return -1;
+  addr = v->start;
+  v->f = f ? filedup(f) : 0;
+  v->off = off;
+
+  if(f == 0 && (flags & MAP_SHARED) && prot != PROT_NONE){
+    for(a = addr; a < addr + len; a += PGSIZE){
+      if((mem = kalloc_zeroed()) == 0)
+        goto bad;
+      if(mappages(p->pgdir, (char*)a, PGSIZE, V2P(mem), vmaperm(v)) < 0){
+        kfree(mem);
+        goto bad;
+      }
+    }
+  }
+  return addr;
+
+bad:
+  vmaunmap(p, v, addr, a);
+  v->start = 0;
+  return -1;
+}
+
+// Remove [addr, addr+len) from the mappings of the current
+// process.  The range must lie within a single mapping.
+// Caller must hold vmlock.
+static int
+munmap1(uint addr, uint len)
+{
+  struct proc *p = myproc();
+  struct vma *v, *nv;
+
+  if(addr % PGSIZE || len == 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if((v = vmalookup(p, addr)) == 0 || addr + len > v->end || addr + len < addr)
+    return -1;
+  // Shared memory segments are only detached as a whole.
+  if(v->shm && (addr != v->start || addr + len != v->end))
+    return -1;
+
+  if(addr > v->start && addr + len < v->end){
+    // Punching a hole splits the mapping in two.
+    if((nv = vmaalloc(p)) == 0)
+      return -1;
+    *nv = *v;
+    nv->start = addr + len;
+    nv->off = v->off + (nv->start - v->start);
+    if(nv->f)
+      filedup(nv->f);
+    vmaunmap(p, v, addr, addr + len);
+    v->end = addr;
+    return 0;
+  }
+
+  vmaunmap(p, v, addr, addr + len);
+  if(addr == v->start && addr + len == v->end)
+    vmafree(v);
+  else if(addr == v->start){
+    v->off += len;
+    v->start = addr + len;
+  } else
+    v->end = addr;
+  return 0;
+}
+
+// The system calls: other threads of the process get the new
+// mappings too.
+uint
+mmap(uint addr, uint len, int prot, int flags, struct file *f, uint off)
+{
+  uint r;
+
+  acquiresleep(&vmlock);
+  r = mmap1(addr, len, prot, flags, f, off);
+  threadsync(myproc());
+  releasesleep(&vmlock);
+  return r;
+}
+
+// munmap() fails if another thread's system call is using part
+// of the range (see pin).
+int
+munmap(uint addr, uint len)
+{
+  int r;
+
+  acquiresleep(&vmlock);
+  if(unmapbegin(myproc(), addr, addr + PGROUNDUP(len)) < 0){
+    releasesleep(&vmlock);
+    return -1;
+  }
+  r = munmap1(addr, len);
+  threadsync(myproc());
+  unmapdone();
+  releasesleep(&vmlock);
+  return r;
+}
+
+// Fill in the page at va of mapping v after a fault.
+// Caller must hold vmlock.  May sleep reading the file.  Returns 0 on success, -1 if
+// the access is not allowed or memory is exhausted.
+int
+vmafault(struct proc *p, struct vma *v, uint va, int write)
+{
+  char *mem, *page;
+
+  if((v->prot & (PROT_READ|PROT_WRITE)) == 0)
+    return -1;
+  if(write && !(v->prot & PROT_WRITE))
+    return -1;
+
+  if(v->shm){
+    if((mem = shmpage(v->shm, (va - v->start) / PGSIZE)) == 0)
+      return -1;
+  } else if(v->f == 0){
+    if((mem = kalloc_zeroed()) == 0)
+      return -1;
+  } else {
+    ilock(v->f->ip);
+    page = pcget(v->f->ip, v->off + (va - v->start), v->flags & MAP_SHARED);
+    iunlock(v->f->ip);
+    if(page == 0)
+      return -1;
+    if((v->flags & MAP_SHARED) || !(v->prot & PROT_WRITE))
+      mem = page;
+    else {
+      if((mem = kalloc()) == 0){
+        kfree(page);
+        return -1;
+      }
+      memmove(mem, page, PGSIZE);
+      kfree(page);
+    }
+  }
+  if(uvmmap(p, va, mem, vmaperm(v), 0) < 0){
+    if(v->f && (v->flags & MAP_SHARED))
+      pcunmap(v->f->ip, v->off + (va - v->start), mem, 0);
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Give child np a copy of the mappings of p.  Pages of shared
+// mappings and read-only pages are shared; private pages are
+// copied.  Returns 0 on success, -1 if memory is exhausted.
+int
+vmadup(struct proc *np, struct proc *p)
+{
+  struct vma *v, *nv;
+  pte_t *pte;
+  uint a, pa, flags;
+  char *mem;
+
+  for(v = p->vma, nv = np->vma; v < &p->vma[NVMA]; v++, nv++){
+    nv->start = 0;
+    if(v->start == 0)
+      continue;
+    *nv = *v;
+    if(nv->f)
+      filedup(nv->f);
+    if(nv->shm)
+      shmdup(nv->shm);
+    for(a = v->start; a < v->end; a += PGSIZE){
+      pte = walkpgdir(p->pgdir, (char*)a, 0);
+      if(!pte){
+        a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+        continue;
+      }
+      if((*pte & PTE_P) == 0)
+        continue;
+      pa = PTE_ADDR(*pte);
+      flags = PTE_FLAGS(*pte);
+      if((v->flags & MAP_SHARED) || !(flags & PTE_W)){
+        kref(P2V(pa));
+        if(mappages(np->pgdir, (char*)a, PGSIZE, pa, flags) < 0){
+          kfree(P2V(pa));
+          goto bad;
+        }
+        if(v->f && (v->flags & MAP_SHARED))
+          pcshare(v->f->ip, v->off + (a - v->start), P2V(pa));
+        continue;
+      }
+      if((mem = kalloc()) == 0)
+        goto bad;
+      memmove(mem, P2V(pa), PGSIZE);
+      if(mappages(np->pgdir, (char*)a, PGSIZE, V2P(mem), flags) < 0){
+        kfree(mem);
+        goto bad;
+      }
+    }
+  }
+  return 0;
+
+bad:
+  // Unmap what was copied, so that the page cache's counts of
+  // shared mappings stay right, and drop the file references.
+  for(nv = np->vma; nv < &np->vma[NVMA]; nv++)
+    if(nv->start){
+      vmaunmap(np, nv, nv->start, nv->end);
+      vmafree(nv);
+    }
+  return -1;
+}
+
+// Remove every mapping of p, writing back dirty shared pages.
+// Used by exit() and by exec() before it replaces the image.
+void
+vmaclear(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->start == 0)
+      continue;
+    vmaunmap(p, v, v->start, v->end);
+    vmafree(v);
+  }
+}
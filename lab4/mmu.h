@@ -6,10 +6,17 @@
 
 // Control Register flags
 #define CR0_PE          0x00000001      // Protection Enable
+#define CR0_MP          0x00000002      // Monitor coProcessor
+#define CR0_EM          0x00000004      // Emulation
+#define CR0_TS          0x00000008      // Task Switched
+#define CR0_NE          0x00000020      // Numeric Error
 #define CR0_WP          0x00010000      // Write Protect
 #define CR0_PG          0x80000000      // Paging
 
 #define CR4_PSE         0x00000010      // Page size extension
+#define CR4_PGE         0x00000080      // Page global enable
+#define CR4_OSFXSR      0x00000200      // fxsave/fxrstor and SSE
+#define CR4_OSXMMEXCPT  0x00000400      // Unmasked SSE exceptions
 
 // various segment selectors.
 #define SEG_KCODE 1  // kernel code
@@ -83,6 +90,7 @@ struct segdesc {
 #define NPDENTRIES      1024    // # directory entries per page directory
 #define NPTENTRIES      1024    // # PTEs per page table
 #define PGSIZE          4096    // bytes mapped by a page
+#define SPGSIZE   (NPTENTRIES*PGSIZE) // bytes mapped by a PTE_PS superpage
 
 #define PTXSHIFT        12      // offset of PTX in a linear address
 #define PDXSHIFT        22      // offset of PDX in a linear address
@@ -94,15 +102,25 @@ struct segdesc {
 #define PTE_P           0x001   // Present
 #define PTE_W           0x002   // Writeable
 #define PTE_U           0x004   // User
+#define PTE_A           0x020   // Accessed
+#define PTE_D           0x040   // Dirty
 #define PTE_PS          0x080   // Page Size
+#define PTE_G           0x100   // Global: survives lcr3 (with CR4_PGE)
+#define PTE_SWAP        0x200   // Not present: paged out (see swap.c)
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uint)(pte) & ~0xFFF)
 #define PTE_FLAGS(pte)  ((uint)(pte) &  0xFFF)
 
-#ifndef __ASSEMBLER__
-typedef uint pte_t;
+// Swap slot holding the page of a PTE_SWAP entry
+#define PTE_SLOT(pte)   (PTE_ADDR(pte) >> PTXSHIFT)
+
+// Page fault error code bits (pushed by the processor on T_PGFLT)
+#define FEC_PR          0x001   // Protection violation (page was present)
+#define FEC_WR          0x002   // Fault caused by a write
+#define FEC_U           0x004   // Fault occurred in user mode
 
+#ifndef __ASSEMBLER__
 // Task state segment format
 struct taskstate {
   uint link;         // Old ts selector
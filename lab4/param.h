@@ -6,9 +6,21 @@
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
+#define NBDEV         2  // disks: device numbers 0 and 1
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define NPSEG         4  // max demand-loaded program segments per process
+#define MAXOPBLOCKS  12  // max # of blocks any FS op writes
+#define LOGSIZE      126  // max data blocks in on-disk log (one header's worth)
+#define NBYPASS      256  // data blocks a transaction may write in place
+#define NBULK        64   // blocks per file append that bypasses the log
+#define NBUF         (LOGSIZE*2+MAXOPBLOCKS*3)  // min size of disk block cache
+#define BUFMEM       32  // 1/BUFMEM of free memory goes to the block cache
+#define NREADAHEAD   16  // blocks read ahead of sequential file reads
+#define FSSIZE       32768 // default size of file system in blocks (mkfs -s)
+#define NPCACHE    1024  // pages in the file page cache
+#define NVMA         16  // memory mappings per process
+#define NZEROPG     256  // pre-zeroed free pages kept by idle CPUs
+#define NSHM         16  // shared memory segments per system
+#define SHMMAXPG    256  // max pages in a shared memory segment
+#define NSWAPPG    4096  // pages of swap space mkfs lays out after the FS
 
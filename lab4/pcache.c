@@ -0,0 +1,265 @@
+// Page cache.
+//
+// The page cache holds whole pages of file contents, keyed by
+// (device, inode number, file offset).  Every process running the
+// same program maps one physical copy of its read-only text from
+// here, and MAP_SHARED file mappings map the cached pages directly,
+// so that mappers of a file see each other's stores.  A shared
+// mapping cannot use a page outside the cache, so when every slot
+// is in use its fault fails rather than quietly going private.
+//
+// Since writes to a file update its cached pages (pcwrite), writing
+// to a program's file while it runs changes the text of the
+// processes running it, as on other systems that map text from
+// the file; exec once gave each process a copy of its own.
+//
+// Interface:
+// * To get the page for offset off of inode ip, call pcget.
+//     ip must be locked; on a miss the page is read from ip.
+//     Pass shared=1 for a MAP_SHARED mapping, which gets 0 rather
+//     than an uncached page if the cache is full.
+// * pclookup is the same but never reads: it returns 0 on a miss.
+// * Both add a reference for the caller (see kref in kalloc.c),
+//     which the caller drops with kfree, normally when the page
+//     is unmapped by deallocuvm.
+// * writei calls pcwrite to keep cached pages up to date;
+//     itrunc calls pcinval to drop them.
+// * Each cached page counts its MAP_SHARED mappings (pcget with
+//     shared=1, pcshare) and whether any of them stored to it.
+//     Unmapping one calls pcunmap with the mapping's PTE_D, and
+//     the last mapping of a page any of them dirtied writes it back.
+//
+// The cache itself holds one reference to each page.  A page
+// whose only remaining reference is the cache's is not mapped
+// anywhere and can be recycled for another (inode, offset).
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+#define NPCHASH 61
+
+struct pcpage {
+  uint dev;
+  uint inum;
+  uint off;
+  char *page;            // 0 if the slot is free
+  int nmap;              // MAP_SHARED mappings of page
+  int dirty;             // one of them stored to it since writeback
+  struct pcpage *next;   // hash chain
+};
+
+struct {
+  struct spinlock lock;
+  struct pcpage pages[NPCACHE];
+  struct pcpage *hash[NPCHASH];
+  uint hand;             // next slot to consider for recycling
+} pcache;
+
+void
+pcinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+}
+
+static uint
+pchash(uint dev, uint inum, uint off)
+{
+  return (dev + inum*31 + off/PGSIZE) % NPCHASH;
+}
+
+// Look for the page holding offset off of ip.
+// Caller must hold pcache.lock.
+static struct pcpage*
+pcfind(struct inode *ip, uint off)
+{
+  struct pcpage *pp;
+
+  for(pp = pcache.hash[pchash(ip->dev, ip->inum, off)]; pp; pp = pp->next)
+    if(pp->dev == ip->dev && pp->inum == ip->inum && pp->off == off)
+      return pp;
+  return 0;
+}
+
+// Drop pp from the cache.  Caller must hold pcache.lock.
+static void
+pcremove(struct pcpage *pp)
+{
+  struct pcpage **pq;
+
+  for(pq = &pcache.hash[pchash(pp->dev, pp->inum, pp->off)]; *pq; pq = &(*pq)->next){
+    if(*pq == pp){
+      *pq = pp->next;
+      break;
+    }
+  }
+  kfree(pp->page);
+  pp->page = 0;
+  pp->nmap = 0;
+  pp->dirty = 0;
+}
+
+// Return the cached page for offset off of ip, or 0 if it
+// is not in the cache.
+char*
+pclookup(struct inode *ip, uint off)
+{
+  struct pcpage *pp;
+  char *page;
+
+  page = 0;
+  acquire(&pcache.lock);
+  if((pp = pcfind(ip, off)) != 0){
+    kref(pp->page);
+    page = pp->page;
+  }
+  release(&pcache.lock);
+  return page;
+}
+
+// Return the page for offset off of ip, reading it on a miss.
+// Bytes past the end of the file read as zero.  If shared, the
+// page is counted as mapped by a MAP_SHARED mapping, and 0 is
+// returned if it cannot be cached.  Returns 0 if memory is
+// exhausted or the read fails.
+char*
+pcget(struct inode *ip, uint off, int shared)
+{
+  struct pcpage *pp;
+  char *mem;
+  uint i, n, h;
+
+  if(!holdingsleep(&ip->lock))
+    panic("pcget");
+  if(off % PGSIZE)
+    panic("pcget: unaligned");
+  mem = 0;
+  acquire(&pcache.lock);
+  if((pp = pcfind(ip, off)) != 0){
+    kref(pp->page);
+    if(shared)
+      pp->nmap++;
+    mem = pp->page;
+  }
+  release(&pcache.lock);
+  if(mem)
+    return mem;
+
+  // Pages are only inserted with ip locked, so nobody
+  // else can add this one while we read it.
+  if((mem = kalloc_zeroed()) == 0)
+    return 0;
+  n = 0;
+  if(off < ip->size)
+    n = ip->size - off < PGSIZE ? ip->size - off : PGSIZE;
+  if(n > 0 && readi(ip, mem, off, n) != n){
+    kfree(mem);
+    return 0;
+  }
+
+  // Recycle a slot that no page table uses any more.  If all
+  // slots are busy a private caller just gets an uncached page;
+  // a shared one gets nothing.
+  acquire(&pcache.lock);
+  for(i = 0; i < NPCACHE; i++){
+    pp = &pcache.pages[pcache.hand];
+    pcache.hand = (pcache.hand + 1) % NPCACHE;
+    if(pp->page == 0 || krefcount(pp->page) == 1){
+      if(pp->page)
+        pcremove(pp);
+      pp->dev = ip->dev;
+      pp->inum = ip->inum;
+      pp->off = off;
+      pp->page = mem;
+      pp->nmap = shared ? 1 : 0;
+      h = pchash(ip->dev, ip->inum, off);
+      pp->next = pcache.hash[h];
+      pcache.hash[h] = pp;
+      kref(mem);
+      break;
+    }
+  }
+  release(&pcache.lock);
+  if(i == NPCACHE && shared){
+    kfree(mem);
+    return 0;
+  }
+  return mem;
+}
+
+// fork() has given a child another MAP_SHARED mapping of page,
+// the page for offset off of ip.
+void
+pcshare(struct inode *ip, uint off, char *page)
+{
+  struct pcpage *pp;
+
+  acquire(&pcache.lock);
+  if((pp = pcfind(ip, off)) != 0 && pp->page == page)
+    pp->nmap++;
+  release(&pcache.lock);
+}
+
+// A MAP_SHARED mapping of page, the page for offset off of ip,
+// is going away; dirty says whether its PTE had PTE_D set.
+// Returns 1 if the caller must write the page back: it was the
+// last shared mapping of a page that one of them stored to, or
+// the page has already been dropped from the cache.
+int
+pcunmap(struct inode *ip, uint off, char *page, int dirty)
+{
+  struct pcpage *pp;
+  int r;
+
+  r = dirty;
+  acquire(&pcache.lock);
+  if((pp = pcfind(ip, off)) != 0 && pp->page == page){
+    pp->dirty |= dirty;
+    r = 0;
+    if(--pp->nmap == 0 && pp->dirty){
+      pp->dirty = 0;
+      r = 1;
+    }
+  }
+  release(&pcache.lock);
+  return r;
+}
+
+// Copy n bytes written at offset off of ip into any cached
+// pages they fall in.  Caller must hold ip->lock.
+void
+pcwrite(struct inode *ip, char *src, uint off, uint n)
+{
+  struct pcpage *pp;
+  uint pgoff, a, end;
+
+  acquire(&pcache.lock);
+  for(pgoff = PGROUNDDOWN(off); pgoff < off + n; pgoff += PGSIZE){
+    if((pp = pcfind(ip, pgoff)) == 0)
+      continue;
+    a = off > pgoff ? off : pgoff;
+    end = off + n < pgoff + PGSIZE ? off + n : pgoff + PGSIZE;
+    memmove(pp->page + (a - pgoff), src + (a - off), end - a);
+  }
+  release(&pcache.lock);
+}
+
+// Drop every cached page of ip.  Processes that still map
+// one keep their reference until they unmap it.
+// Caller must hold ip->lock.
+void
+pcinval(struct inode *ip)
+{
+  struct pcpage *pp;
+
+  acquire(&pcache.lock);
+  for(pp = pcache.pages; pp < &pcache.pages[NPCACHE]; pp++)
+    if(pp->page && pp->dev == ip->dev && pp->inum == ip->inum)
+      pcremove(pp);
+  release(&pcache.lock);
+}
@@ -0,0 +1,111 @@
+// PCI bus enumeration, through configuration mechanism #1.
+//
+// pciinit scans every bus for devices and records each function
+// in pcidevs.  Drivers look up their device with pcifind and turn
+// on its decoding and bus mastering with pcienable.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "pci.h"
+
+#define CONFADDR 0xCF8
+#define CONFDATA 0xCFC
+#define NPCIDEV  32
+
+static struct pcidev pcidevs[NPCIDEV];
+static int npcidev;
+
+static uint
+confaddr(struct pcidev *d, uint off)
+{
+  return 0x80000000 | (d->bus << 16) | (d->dev << 11) | (d->func << 8) |
+         (off & 0xFC);
+}
+
+uint
+pciread(struct pcidev *d, uint off)
+{
+  outl(CONFADDR, confaddr(d, off));
+  return inl(CONFDATA);
+}
+
+void
+pciwrite(struct pcidev *d, uint off, uint v)
+{
+  outl(CONFADDR, confaddr(d, off));
+  outl(CONFDATA, v);
+}
+
+// Record function d if it exists.  Returns 0 if it does not.
+static int
+pciprobe(struct pcidev *d)
+{
+  uint id, class, bar;
+  int i;
+
+  id = pciread(d, PCI_ID);
+  if((id & 0xFFFF) == 0xFFFF)
+    return 0;
+  d->vendor = id & 0xFFFF;
+  d->device = id >> 16;
+  class = pciread(d, PCI_CLASS);
+  d->class = class >> 24;
+  d->subclass = class >> 16;
+  d->progif = class >> 8;
+  d->irq = pciread(d, PCI_INTR);
+  for(i = 0; i < 6; i++){
+    bar = pciread(d, PCI_BAR0 + 4*i);
+    d->baseio[i] = bar & 1;
+    d->bar[i] = bar & 1 ? bar & ~3 : bar & ~0xF;
+  }
+  if(npcidev < NPCIDEV)
+    pcidevs[npcidev++] = *d;
+  return 1;
+}
+
+void
+pciinit(void)
+{
+  struct pcidev d;
+  uint nfunc;
+
+  for(d.bus = 0; ; d.bus++){
+    for(d.dev = 0; d.dev < 32; d.dev++){
+      d.func = 0;
+      if(!pciprobe(&d))
+        continue;
+      // Multi-function devices have up to 8 functions.
+      nfunc = pciread(&d, PCI_HDR) & 0x800000 ? 8 : 1;
+      for(d.func = 1; d.func < nfunc; d.func++)
+        pciprobe(&d);
+    }
+    if(d.bus == 255)
+      break;
+  }
+}
+
+// Return the first device with the given vendor and device ID,
+// or, if vendor is 0, the first of the given class and subclass.
+// Returns 0 if there is none.
+struct pcidev*
+pcifind(ushort vendor, ushort device, uchar class, uchar subclass)
+{
+  struct pcidev *d;
+
+  for(d = pcidevs; d < &pcidevs[npcidev]; d++){
+    if(vendor ? d->vendor == vendor && d->device == device
+              : d->class == class && d->subclass == subclass)
+      return d;
+  }
+  return 0;
+}
+
+// Turn on I/O and memory decoding and bus mastering for d.
+void
+pcienable(struct pcidev *d)
+{
+  pciwrite(d, PCI_CMD, pciread(d, PCI_CMD) |
+           PCI_CMD_IO | PCI_CMD_MEM | PCI_CMD_MASTER);
+}
@@ -0,0 +1,25 @@
+// PCI configuration space.
+
+// Configuration registers.
+#define PCI_ID       0x00  // device ID [31:16], vendor ID [15:0]
+#define PCI_CMD      0x04  // command [15:0]
+  #define PCI_CMD_IO     0x1      // decode I/O space
+  #define PCI_CMD_MEM    0x2      // decode memory space
+  #define PCI_CMD_MASTER 0x4      // bus master
+#define PCI_CLASS    0x08  // class [31:24], subclass [23:16], prog if [15:8]
+#define PCI_HDR      0x0C  // header type [23:16]
+#define PCI_BAR0     0x10  // base address registers, 6 of them
+#define PCI_INTR     0x3C  // interrupt line [7:0]
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUB_IDE       0x01
+
+// A function found on the bus by pciinit.
+struct pcidev {
+  uchar bus, dev, func;
+  ushort vendor, device;
+  uchar class, subclass, progif;
+  uint bar[6];       // base addresses, I/O or memory, flag bits cleared
+  uchar baseio[6];   // bar[i] is in I/O space
+  uchar irq;
+};
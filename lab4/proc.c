@@ -6,6 +6,7 @@
 #include "x86.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 
 #define N 5
 #define EATING 0
@@ -30,16 +31,31 @@ int state[N];
 
 static struct proc *initproc;
 
+// Serializes changes to the layout of address spaces (sbrk
+// shrinking, mmap, munmap) and faults on mmap() regions, so that
+// threads sharing an address space see them in order.
+struct sleeplock vmlock;
+
+// The range a munmap() is taking away from address space pgdir,
+// while it does, so that argbuf cannot pin it meanwhile.  vmlock
+// lets one run at a time; ptable.lock protects this.
+static struct {
+  pde_t *pgdir;
+  uint start, end;
+} unmapping;
+
 int nextpid = 1;
 extern void forkret(void);
 extern void trapret(void);
 
 static void wakeup1(void *chan);
+static int pinned(pde_t*, uint, uint);
 
 void
 pinit(void)
 {
   initlock(&ptable.lock, "ptable");
+  initsleeplock(&vmlock, "vm");
 }
 
 // Must be called with interrupts disabled
@@ -104,6 +120,10 @@ allocproc(void)
 found:
   p->state = EMBRYO;
   p->pid = nextpid++;
+  p->fpused = 0;
+  p->fpcpu = 0;
+  p->isthread = 0;
+  p->pinstart = p->pinend = 0;
 
   release(&ptable.lock);
 
@@ -169,27 +189,179 @@ userinit(void)
   release(&ptable.lock);
 }
 
-// Grow current process's memory by n bytes.
-// Return 0 on success, -1 on failure.
+// A kernel process starts here, from the scheduler.
+static void
+kprocstart(void)
+{
+  release(&ptable.lock);
+  myproc()->kfn();
+  panic("kproc returned");
+}
+
+// Start a kernel process that runs fn, which must not return.
+// It has no user memory and runs only in the kernel.
+void
+kproc(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0 || (p->pgdir = setupkvm()) == 0)
+    panic("kproc");
+  p->sz = 0;
+  p->kfn = fn;
+  p->context->eip = (uint)kprocstart;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+  p->state = RUNNABLE;
+  release(&ptable.lock);
+}
+
+// Grow current process's memory by n bytes, or shrink it if n is
+// negative.  Growing only reserves address space; pages are
+// allocated on first touch by the page fault handler (see
+// uvmfault).  Shrinking frees the pages right away, except for
+// a superpage that cannot be split, which stays mapped until exit
+// with the part above the new size zeroed (see deallocuvm).
+// Threads sharing the address space all get the new size.
+// Returns the old size, or -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint sz, newsz;
   struct proc *curproc = myproc();
+  struct proc *p;
 
+  acquiresleep(&vmlock);
+  acquire(&ptable.lock);
   sz = curproc->sz;
-  if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
-      return -1;
-  } else if(n < 0){
-    if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
-      return -1;
+  newsz = sz + n;
+  if(n > 0 ? newsz < sz || newsz >= MMAPBASE : newsz > sz){
+    release(&ptable.lock);
+    releasesleep(&vmlock);
+    return -1;
+  }
+  // Another thread's system call may be using the memory.
+  if(n < 0 && pinned(curproc->pgdir, newsz, sz)){
+    release(&ptable.lock);
+    releasesleep(&vmlock);
+    return -1;
   }
-  curproc->sz = sz;
-  switchuvm(curproc);
+  acquire(&uvmlock);  // see uvmmap
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    if(p->state != UNUSED && p->pgdir == curproc->pgdir)
+      p->sz = newsz;
+  release(&uvmlock);
+  release(&ptable.lock);
+  if(n < 0)
+    deallocuvm(curproc->pgdir, sz, newsz);
+  releasesleep(&vmlock);
+  return sz;
+}
+
+// Does a thread using pgdir have part of [start, end) pinned for
+// a system call in progress?  Caller must hold ptable.lock.
+static int
+pinned(pde_t *pgdir, uint start, uint end)
+{
+  struct proc *q;
+
+  for(q = ptable.proc; q < &ptable.proc[NPROC]; q++)
+    if(q->state != UNUSED && q->pgdir == pgdir && q->pinend != 0 &&
+       start < q->pinend && end > q->pinstart)
+      return 1;
+  return 0;
+}
+
+// Pin [start, end) of p's memory until p's current system call
+// returns: it is not paged out (see swappable), and other threads
+// cannot munmap() it or sbrk() it away, so the kernel can use it
+// without faulting.  Fails if another thread is unmapping part of
+// it; the caller checks that the range is mapped only after this.
+int
+pin(struct proc *p, uint start, uint end)
+{
+  acquire(&ptable.lock);
+  if(unmapping.pgdir == p->pgdir && start < unmapping.end &&
+     end > unmapping.start){
+    release(&ptable.lock);
+    return -1;
+  }
+  if(p->pinend == 0 || start < p->pinstart)
+    p->pinstart = start;
+  if(end > p->pinend)
+    p->pinend = end;
+  release(&ptable.lock);
   return 0;
 }
 
+// munmap() is about to take [start, end) away from p's address
+// space.  Fails if a thread has part of it pinned; otherwise it
+// cannot be pinned until unmapdone.  Caller must hold vmlock.
+int
+unmapbegin(struct proc *p, uint start, uint end)
+{
+  acquire(&ptable.lock);
+  if(pinned(p->pgdir, start, end)){
+    release(&ptable.lock);
+    return -1;
+  }
+  unmapping.pgdir = p->pgdir;
+  unmapping.start = start;
+  unmapping.end = end;
+  release(&ptable.lock);
+  return 0;
+}
+
+void
+unmapdone(void)
+{
+  acquire(&ptable.lock);
+  unmapping.pgdir = 0;
+  release(&ptable.lock);
+}
+
+// Copy the memory mappings of p to the other threads sharing its
+// address space, after mmap() or munmap() changed them.
+// Caller must hold vmlock.
+void
+threadsync(struct proc *p)
+{
+  struct proc *q;
+
+  acquire(&ptable.lock);
+  for(q = ptable.proc; q < &ptable.proc[NPROC]; q++)
+    if(q != p && q->state != UNUSED && q->pgdir == p->pgdir)
+      memmove(q->vma, p->vma, sizeof(p->vma));
+  release(&ptable.lock);
+}
+
+// If other threads share the address space of p, leave it to
+// them: p switches to the kernel-only page table and forgets its
+// copy of the mappings.  Returns 1 if p left, or 0 if p is the
+// only user, in which case the caller tears the address space
+// down.  Used by exit() and exec().
+int
+leavevm(struct proc *p)
+{
+  pde_t *pgdir;
+
+  acquire(&ptable.lock);
+  // Each thread holds a reference to the page directory page.
+  pgdir = p->pgdir;
+  if(krefcount((char*)pgdir) == 1){
+    release(&ptable.lock);
+    return 0;
+  }
+  p->pgdir = kpgdir;
+  switchkvm();
+  mycpu()->pgdir = 0;
+  kfree((char*)pgdir);
+  memset(p->vma, 0, sizeof(p->vma));
+  release(&ptable.lock);
+  return 1;
+}
+
 // Create a new process copying p as the parent.
 // Sets up stack to return as if from system call.
 // Caller must set state of returned proc to RUNNABLE.
@@ -205,13 +377,26 @@ fork(void)
     return -1;
   }
 
-  // Copy process state from proc.
+  // Copy process state from proc.  copyuvm may sleep in
+  // swapalloc between reading a page's address and copying it, so
+  // pin the whole address space, as argptr pins a buffer: no page
+  // of it may be paged out and freed meanwhile.  syscall() unpins.
+  curproc->pinstart = 0;
+  curproc->pinend = curproc->sz;
   if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
     kfree(np->kstack);
     np->kstack = 0;
     np->state = UNUSED;
     return -1;
   }
+  if(vmadup(np, curproc) < 0){
+    freevm(np->pgdir);
+    np->pgdir = 0;
+    kfree(np->kstack);
+    np->kstack = 0;
+    np->state = UNUSED;
+    return -1;
+  }
   np->sz = curproc->sz;
   np->parent = curproc;
   *np->tf = *curproc->tf;
@@ -223,6 +408,73 @@ fork(void)
     if(curproc->ofile[i])
       np->ofile[i] = filedup(curproc->ofile[i]);
   np->cwd = idup(curproc->cwd);
+  if(curproc->exe)
+    np->exe = idup(curproc->exe);
+  memmove(np->pseg, curproc->pseg, sizeof(curproc->pseg));
+  np->npseg = curproc->npseg;
+  fpufork(np, curproc);
+
+  safestrcpy(np->name, curproc->name, sizeof(curproc->name));
+
+  pid = np->pid;
+
+  acquire(&ptable.lock);
+
+  np->state = RUNNABLE;
+
+  release(&ptable.lock);
+
+  return pid;
+}
+
+// Create a thread: a process that shares the address space of the
+// current one, and starts running fn(arg) on the one-page user
+// stack at stack.  Open files and the current directory are
+// shared like fork() shares them.  fn must not return; it has no
+// caller.  Returns the new thread's pid, or -1.
+int
+clone(uint fn, uint arg, uint stack)
+{
+  int i, pid;
+  uint sp, ustack[2];
+  struct proc *np;
+  struct proc *curproc = myproc();
+
+  // Fault the top of the stack in now, so copyout can fill it.
+  sp = stack + PGSIZE - sizeof(ustack);
+  if(stack + PGSIZE < stack || uvmfault(curproc, sp, 1) < 0 ||
+     uvmfault(curproc, sp + sizeof(ustack) - 1, 1) < 0)
+    return -1;
+  ustack[0] = 0xffffffff;  // fake return PC
+  ustack[1] = arg;
+  if(copyout(curproc->pgdir, sp, ustack, sizeof(ustack)) < 0)
+    return -1;
+
+  if((np = allocproc()) == 0)
+    return -1;
+
+  acquire(&ptable.lock);
+  kref((char*)curproc->pgdir);
+  np->pgdir = curproc->pgdir;
+  np->sz = curproc->sz;
+  memmove(np->vma, curproc->vma, sizeof(curproc->vma));
+  release(&ptable.lock);
+  np->isthread = 1;
+  np->ustack = stack;
+  np->parent = curproc;
+  *np->tf = *curproc->tf;
+  np->tf->eip = fn;
+  np->tf->esp = sp;
+
+  for(i = 0; i < NOFILE; i++)
+    if(curproc->ofile[i])
+      np->ofile[i] = filedup(curproc->ofile[i]);
+  np->cwd = idup(curproc->cwd);
+  if(curproc->exe)
+    np->exe = idup(curproc->exe);
+  memmove(np->pseg, curproc->pseg, sizeof(curproc->pseg));
+  np->npseg = curproc->npseg;
+  fpufork(np, curproc);
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
@@ -237,6 +489,23 @@ fork(void)
   return pid;
 }
 
+// Free what is left of a zombie, for wait() and join().
+// Caller must hold ptable.lock.
+static void
+freeproc(struct proc *p)
+{
+  kfree(p->kstack);
+  p->kstack = 0;
+  if(p->pgdir != kpgdir)
+    freevm(p->pgdir);
+  p->pgdir = 0;
+  p->pid = 0;
+  p->parent = 0;
+  p->name[0] = 0;
+  p->killed = 0;
+  p->state = UNUSED;
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
@@ -250,6 +519,11 @@ exit(void)
   if(curproc == initproc)
     panic("init exiting");
 
+  // Write back and drop memory mappings, unless other threads
+  // still use them.
+  if(!leavevm(curproc))
+    vmaclear(curproc);
+
   // Close all open files.
   for(fd = 0; fd < NOFILE; fd++){
     if(curproc->ofile[fd]){
@@ -260,18 +534,24 @@ exit(void)
 
   begin_op();
   iput(curproc->cwd);
+  if(curproc->exe)
+    iput(curproc->exe);
   end_op();
   curproc->cwd = 0;
+  curproc->exe = 0;
+  curproc->npseg = 0;
 
   acquire(&ptable.lock);
 
   // Parent might be sleeping in wait().
   wakeup1(curproc->parent);
 
-  // Pass abandoned children to init.
+  // Pass abandoned children to init, which reaps threads
+  // with wait() like any other process.
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
     if(p->parent == curproc){
       p->parent = initproc;
+      p->isthread = 0;
       if(p->state == ZOMBIE)
         wakeup1(initproc);
     }
@@ -297,20 +577,13 @@ wait(void)
     // Scan through table looking for exited children.
     havekids = 0;
     for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->parent != curproc)
+      if(p->parent != curproc || p->isthread)
         continue;
       havekids = 1;
       if(p->state == ZOMBIE){
         // Found one.
         pid = p->pid;
-        kfree(p->kstack);
-        p->kstack = 0;
-        freevm(p->pgdir);
-        p->pid = 0;
-        p->parent = 0;
-        p->name[0] = 0;
-        p->killed = 0;
-        p->state = UNUSED;
+        freeproc(p);
         release(&ptable.lock);
         return pid;
       }
@@ -327,6 +600,42 @@ wait(void)
   }
 }
 
+// Wait for a thread created by this process with clone() to exit.
+// Stores the thread's user stack in *stack, so that the caller
+// can free it, and returns the thread's pid, or -1 if this
+// process has no threads.
+int
+join(uint *stack)
+{
+  struct proc *p;
+  int havekids, pid;
+  struct proc *curproc = myproc();
+
+  acquire(&ptable.lock);
+  for(;;){
+    havekids = 0;
+    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+      if(p->parent != curproc || !p->isthread)
+        continue;
+      havekids = 1;
+      if(p->state == ZOMBIE){
+        pid = p->pid;
+        *stack = p->ustack;
+        freeproc(p);
+        release(&ptable.lock);
+        return pid;
+      }
+    }
+
+    if(!havekids || curproc->killed){
+      release(&ptable.lock);
+      return -1;
+    }
+
+    sleep(curproc, &ptable.lock);
+  }
+}
+
 //PAGEBREAK: 42
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
@@ -340,6 +649,7 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int ran;
   c->proc = 0;
   
   for(;;){
@@ -347,20 +657,25 @@ scheduler(void)
     sti();
 
     // Loop over process table looking for process to run.
+    ran = 0;
     acquire(&ptable.lock);
     for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
       if(p->state != RUNNABLE)
         continue;
+      ran = 1;
 
       // Switch to chosen process.  It is the process's job
       // to release ptable.lock and then reacquire it
       // before jumping back to us.
       c->proc = p;
       switchuvm(p);
+      fpuswitchin(p);
       p->state = RUNNING;
 
       swtch(&(c->scheduler), p->context);
+      fpuswitchout(p);
       switchkvm();
+      c->pgdir = 0;
 
       // Process is done running for now.
       // It should have changed its p->state before coming back.
@@ -368,6 +683,9 @@ scheduler(void)
     }
     release(&ptable.lock);
 
+    // Nothing to run: clear a free page for kalloc_zeroed.
+    if(!ran)
+      kzeroidle();
   }
 }
 
@@ -512,6 +830,69 @@ kill(int pid)
   return -1;
 }
 
+// Can swappick take pages from the address space of p?  No thread
+// using it may be running, and p must be the first of them in the
+// table, so that each address space is swept once.  Sets
+// [*pinstart, *pinend) to cover the buffers the threads' system
+// calls have pinned.  Caller must hold ptable.lock.
+static int
+swappable(struct proc *p, uint *pinstart, uint *pinend)
+{
+  struct proc *q;
+
+  if(p->state != SLEEPING && p->state != RUNNABLE)
+    return 0;
+  *pinstart = *pinend = 0;
+  for(q = ptable.proc; q < &ptable.proc[NPROC]; q++){
+    if(q->state == UNUSED || q->pgdir != p->pgdir)
+      continue;
+    if(q->state == RUNNING || q < p)
+      return 0;
+    if(q->pinend == 0)
+      continue;
+    if(*pinend == 0 || q->pinstart < *pinstart)
+      *pinstart = q->pinstart;
+    if(q->pinend > *pinend)
+      *pinend = q->pinend;
+  }
+  return 1;
+}
+
+// Choose up to n pages to page out (see swap.c), going round the
+// process table and through each process's memory like the hand
+// of a clock.  Only address spaces that no CPU is running are
+// considered: no TLB holds their user mappings, because a CPU
+// that stops running a process switches to kpgdir before it
+// releases ptable.lock.  Returns the number of pages chosen; each
+// is no longer mapped, and the caller writes it to slots[i] and
+// frees it.
+int
+swappick(char **pages, uint *slots, int n)
+{
+  static int hand;    // process the clock hand is at
+  static uint handva; // and the address in it
+  struct proc *p;
+  uint pinstart, pinend;
+  int i, nv;
+
+  nv = 0;
+  acquire(&ptable.lock);
+  // Two trips round, so pages whose accessed bit the first
+  // trip cleared can be taken on the second.
+  for(i = 0; i <= 2*NPROC && nv < n; i++){
+    p = &ptable.proc[hand];
+    if(swappable(p, &pinstart, &pinend))
+      nv += uvmclock(p, pinstart, pinend, &handva,
+                     pages + nv, slots + nv, n - nv);
+    if(nv < n){
+      hand = (hand + 1) % NPROC;
+      handva = 0;
+    }
+  }
+  release(&ptable.lock);
+  return nv;
+}
+
 //PAGEBREAK: 36
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
@@ -8,11 +8,22 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  struct proc *fpu;            // Process whose FPU state is loaded, or 0
+  pde_t *pgdir;                // User page table loaded, or 0 (see tlbflush)
 };
 
 extern struct cpu cpus[NCPU];
 extern int ncpu;
 
+// Pages unmapped from a page table shared by threads, to be freed
+// after a single TLB shootdown (see tlbbatchadd in vm.c).
+struct tlbbatch {
+  pde_t *pgdir;
+  int n;
+  char *pages[32];
+  uchar big[32];               // pages[i] is a superpage
+};
+
 //PAGEBREAK: 17
 // Saved registers for kernel context switches.
 // Don't need to save all the segment registers (%cs, etc),
@@ -34,6 +45,27 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A loadable ELF segment whose pages exec() left to be read
+// from the executable on first touch (see uvmfault in vm.c).
+struct pseg {
+  uint va;                     // Start address, not necessarily page-aligned
+  uint off;                    // File offset of the first byte
+  uint filesz;                 // Bytes that come from the file
+  uint memsz;                  // Total bytes; the rest is zero-filled bss
+  uint flags;                  // ELF_PROG_FLAG_* permissions
+};
+
+// A memory mapping created by mmap(), see mmap.c.
+struct vma {
+  uint start;                  // First address, page-aligned; 0 if unused
+  uint end;                    // One past the last address, page-aligned
+  int prot;                    // PROT_* bits
+  int flags;                   // MAP_* bits
+  struct file *f;              // Mapped file, 0 for anonymous memory
+  uint off;                    // File offset mapped at start
+  struct shm *shm;             // Attached shared memory segment, or 0
+};
+
 // Per-process state
 struct proc {
   uint sz;                     // Size of process memory (bytes)
@@ -48,7 +80,19 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct inode *exe;           // Executable backing the pseg pages
+  struct pseg pseg[NPSEG];     // Segments to demand-load from exe
+  int npseg;                   // Number of valid entries in pseg
+  struct vma vma[NVMA];        // mmap() regions
+  uint pinstart, pinend;       // User buffers of the current system call,
+                               //   not to be paged out or unmapped (see pin)
+  int isthread;                // Created by clone(), for join() to reap
+  uint ustack;                 // User stack passed to clone()
+  void (*kfn)(void);           // Kernel process: what it runs (see kproc)
   char name[16];               // Process name (debugging)
+  int fpused;                  // Has the process used the FPU?
+  struct cpu *fpcpu;           // CPU holding its latest FPU state, or 0
+  char fxarea[512] __attribute__((aligned(16))); // Saved FPU/SSE state
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -0,0 +1,171 @@
+// Shared memory segments.
+//
+// A segment is a named run of physical pages that any process can
+// attach with shm_open(name, size, addr).  The first shm_open of a
+// name creates the segment; later ones attach the same pages, so
+// unrelated processes can exchange data through memory.
+//
+// Each attachment is a struct vma (see mmap.c) pointing at the
+// segment.  Pages are allocated on first touch by any attacher and
+// mapped into the others when they fault on them.  fork() gives
+// the child its own attachment, and munmap(), shm_close(), exec()
+// and exit() drop one.  A segment goes away with its last
+// attachment.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "mman.h"
+
+#define SHMNAME 16
+
+struct shm {
+  char name[SHMNAME];
+  int ref;                 // attachments; 0 if the slot is free
+  uint npages;
+  char *pages[SHMMAXPG];   // 0 until first touched
+};
+
+struct {
+  struct spinlock lock;
+  struct shm shm[NSHM];
+} shmtab;
+
+void
+shminit(void)
+{
+  initlock(&shmtab.lock, "shm");
+}
+
+// Find the segment called name, or create it with npages pages.
+// Returns the segment with a reference added for the caller,
+// or 0 if it is too small or there is no free slot.
+static struct shm*
+shmget(char *name, uint npages)
+{
+  struct shm *s, *empty;
+
+  acquire(&shmtab.lock);
+  empty = 0;
+  for(s = shmtab.shm; s < &shmtab.shm[NSHM]; s++){
+    if(s->ref > 0 && strncmp(s->name, name, SHMNAME) == 0){
+      if(npages > s->npages){
+        release(&shmtab.lock);
+        return 0;
+      }
+      s->ref++;
+      release(&shmtab.lock);
+      return s;
+    }
+    if(empty == 0 && s->ref == 0)
+      empty = s;
+  }
+  if(empty == 0 || npages == 0){
+    release(&shmtab.lock);
+    return 0;
+  }
+  s = empty;
+  safestrcpy(s->name, name, SHMNAME);
+  s->ref = 1;
+  s->npages = npages;
+  memset(s->pages, 0, sizeof(s->pages));
+  release(&shmtab.lock);
+  return s;
+}
+
+void
+shmdup(struct shm *s)
+{
+  acquire(&shmtab.lock);
+  if(s->ref < 1)
+    panic("shmdup");
+  s->ref++;
+  release(&shmtab.lock);
+}
+
+// Drop an attachment.  The last one frees the pages.
+void
+shmput(struct shm *s)
+{
+  uint i;
+
+  acquire(&shmtab.lock);
+  if(s->ref < 1)
+    panic("shmput");
+  if(--s->ref == 0){
+    for(i = 0; i < s->npages; i++){
+      if(s->pages[i])
+        kfree(s->pages[i]);
+      s->pages[i] = 0;
+    }
+  }
+  release(&shmtab.lock);
+}
+
+// Return page i of s, allocating it if nobody has touched it
+// yet, with a reference added for the caller's page table.
+// Returns 0 if memory is exhausted.
+char*
+shmpage(struct shm *s, uint i)
+{
+  char *mem;
+
+  if(i >= s->npages)
+    panic("shmpage");
+  acquire(&shmtab.lock);
+  if((mem = s->pages[i]) == 0){
+    if((mem = kalloc_zeroed()) == 0){
+      release(&shmtab.lock);
+      return 0;
+    }
+    s->pages[i] = mem;
+  }
+  kref(mem);
+  release(&shmtab.lock);
+  return mem;
+}
+
+// Attach the segment called name to the current process at addr,
+// or wherever there is room if addr is 0, creating the segment
+// with size bytes if it does not exist.  Attaching an existing
+// segment maps all of it; size may be 0.
+// Returns the address of the attachment, or -1.
+uint
+shm_open(char *name, uint size, uint addr)
+{
+  struct shm *s;
+  struct vma *v;
+
+  if(size > SHMMAXPG*PGSIZE)
+    return -1;
+  if((s = shmget(name, PGROUNDUP(size) / PGSIZE)) == 0)
+    return -1;
+  acquiresleep(&vmlock);
+  if((v = vmacreate(myproc(), addr, s->npages*PGSIZE,
+                    PROT_READ|PROT_WRITE, MAP_SHARED)) == 0){
+    releasesleep(&vmlock);
+    shmput(s);
+    return -1;
+  }
+  v->shm = s;
+  addr = v->start;
+  threadsync(myproc());
+  releasesleep(&vmlock);
+  return addr;
+}
+
+// Detach the segment attached at addr.
+int
+shm_close(uint addr)
+{
+  struct vma *v;
+
+  if((v = vmalookup(myproc(), addr)) == 0 || v->shm == 0 || v->start != addr)
+    return -1;
+  return munmap(v->start, v->end - v->start);
+}
@@ -1,14 +1,28 @@
 #include "types.h"
 #include "x86.h"
 
+// The mem* routines move whole words with rep movsl/stosl once
+// the destination is word-aligned.  The kernel does not touch the
+// FPU (see fpu.c), so there are no SSE versions here.
+
 void*
 memset(void *dst, int c, uint n)
 {
-  if ((int)dst%4 == 0 && n%4 == 0){
-    c &= 0xFF;
-    stosl(dst, (c<<24)|(c<<16)|(c<<8)|c, n/4);
-  } else
-    stosb(dst, c, n);
+  char *d;
+  uint m;
+
+  d = dst;
+  c &= 0xFF;
+  if(n >= 16){
+    m = -(uint)d % 4;
+    stosb(d, c, m);
+    d += m;
+    n -= m;
+    stosl(d, (c<<24)|(c<<16)|(c<<8)|c, n/4);
+    d += n & ~3;
+    n %= 4;
+  }
+  stosb(d, c, n);
   return dst;
 }
 
@@ -19,6 +33,11 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+  // Skip equal words, then find the differing byte.
+  while(n >= 4 && *(uint*)s1 == *(uint*)s2){
+    s1 += 4, s2 += 4;
+    n -= 4;
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -31,19 +50,49 @@ memcmp(const void *v1, const void *v2, uint n)
 void*
 memmove(void *dst, const void *src, uint n)
 {
-  const char *s;
-  char *d;
+  const char *s, *sw;
+  char *d, *dw;
+  uint m;
 
   s = src;
   d = dst;
   if(s < d && s + n > d){
+    // Overlapping with dst above src: copy from the top down.
     s += n;
     d += n;
-    while(n-- > 0)
+    m = (uint)d % 4;
+    if(n < 16)
+      m = n;
+    n -= m;
+    while(m-- > 0)
       *--d = *--s;
-  } else
+    if(n >= 4){
+      dw = d - 4;
+      sw = s - 4;
+      m = n / 4;
+      // alltraps clears DF again for anything that interrupts this.
+      asm volatile("std; rep movsl; cld" :
+                   "+D" (dw), "+S" (sw), "+c" (m) : : "memory", "cc");
+      d -= n & ~3;
+      s -= n & ~3;
+      n %= 4;
+    }
     while(n-- > 0)
-      *d++ = *s++;
+      *--d = *--s;
+  } else {
+    if(n >= 16){
+      m = -(uint)d % 4;
+      movsb(d, s, m);
+      d += m;
+      s += m;
+      n -= m;
+      movsl(d, s, n/4);
+      d += n & ~3;
+      s += n & ~3;
+      n %= 4;
+    }
+    movsb(d, s, n);
+  }
 
   return dst;
 }
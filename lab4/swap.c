@@ -0,0 +1,220 @@
+// Paging to disk.
+//
+// mkfs lays out a swap area of sb.nswap blocks after the file
+// system, which holds up to NSWAPPG pages in slots of one page.
+// When free memory runs low, swapalloc pages out private pages of
+// processes that are not running, so that memory can be
+// overcommitted across many mostly idle processes:
+// * swappick (proc.c) and uvmclock (vm.c) choose the pages with a
+//     clock sweep over the processes' page tables, giving pages the
+//     hardware has marked accessed (PTE_A) a second chance.
+// * A page that goes out has its PTE replaced by a PTE_SWAP entry
+//     that records the slot (PTE_SLOT) and the page's permissions.
+// * A fault on such an entry calls swapin, which reads the page
+//     back into a fresh page.
+// * fork() shares slots between parent and child (swapdup), and
+//     deallocuvm drops them (swapfree); a slot is free when no page
+//     table refers to it.
+// Only pages below p->sz that are writable, user-accessible and
+// mapped by a single page table are paged out; shared text, mmap()
+// regions and the user buffers of a system call in progress stay.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "swap.h"
+
+#define SWAPBATCH 32  // pages paged out per call of swapout
+#define SWAPLOW   64  // page out when fewer pages are free
+
+extern struct superblock sb;
+
+struct {
+  struct spinlock lock;
+  ushort ref[NSWAPPG]; // page table entries referring to each slot
+  uint rover;          // where to look for a free slot next
+  uint nin, nout;
+  struct sleeplock io; // serializes swap I/O and slot allocation
+  struct buf buf;      // for I/O, outside the buffer cache
+} swap;
+
+void
+swapinit(void)
+{
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.io, "swapio");
+  initsleeplock(&swap.buf.lock, "swapbuf");
+}
+
+// Number of slots in the swap area; 0 if the disk has none.
+static uint
+swapslots(void)
+{
+  uint n;
+
+  n = sb.nswap / (PGSIZE/BSIZE);
+  return n < NSWAPPG ? n : NSWAPPG;
+}
+
+// Read or write the page at mem from or to slot.
+// Caller must hold swap.io.
+static void
+swaprw(char *mem, uint slot, int write)
+{
+  struct buf *b = &swap.buf;
+  uint i;
+
+  acquiresleep(&b->lock);
+  for(i = 0; i < PGSIZE/BSIZE; i++){
+    b->dev = ROOTDEV;
+    b->blockno = sb.swapstart + slot*(PGSIZE/BSIZE) + i;
+    if(write){
+      memmove(b->data, mem + i*BSIZE, BSIZE);
+      b->flags = B_DIRTY;
+    } else
+      b->flags = 0;
+    diskrw(b);
+    if(!write)
+      memmove(mem + i*BSIZE, b->data, BSIZE);
+  }
+  releasesleep(&b->lock);
+}
+
+// Allocate a swap slot with one reference.
+// Returns the slot, or -1 if swap is full.
+int
+swapslot(void)
+{
+  uint i, n, s;
+
+  n = swapslots();
+  acquire(&swap.lock);
+  for(i = 0; i < n; i++){
+    s = (swap.rover + i) % n;
+    if(swap.ref[s] == 0){
+      swap.ref[s] = 1;
+      swap.rover = s + 1;
+      release(&swap.lock);
+      return s;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+// Add a reference to slot, for a copied page table.
+void
+swapdup(uint slot)
+{
+  acquire(&swap.lock);
+  if(slot >= NSWAPPG || swap.ref[slot] == 0 || swap.ref[slot] == 0xFFFF)
+    panic("swapdup");
+  swap.ref[slot]++;
+  release(&swap.lock);
+}
+
+// Drop a reference to slot.
+void
+swapfree(uint slot)
+{
+  acquire(&swap.lock);
+  if(slot >= NSWAPPG || swap.ref[slot] == 0)
+    panic("swapfree");
+  swap.ref[slot]--;
+  release(&swap.lock);
+}
+
+// Page out up to n (at most SWAPBATCH) pages of processes that
+// are not running.  Returns the number of pages freed.
+int
+swapout(int n)
+{
+  char *pages[SWAPBATCH];
+  uint slots[SWAPBATCH];
+  int i;
+
+  if(n > SWAPBATCH)
+    n = SWAPBATCH;
+  if(swapslots() == 0)
+    return 0;
+
+  // Holding swap.io from the choice to the end of the writes
+  // makes a swapin of one of these pages wait for its write.
+  acquiresleep(&swap.io);
+  n = swappick(pages, slots, n);
+  for(i = 0; i < n; i++){
+    swaprw(pages[i], slots[i], 1);
+    kfree(pages[i]);
+  }
+  releasesleep(&swap.io);
+
+  acquire(&swap.lock);
+  swap.nout += n;
+  release(&swap.lock);
+  return n;
+}
+
+// Allocate a zeroed page for user memory.  When free memory runs
+// low, first page out pages of idle processes, so that there is
+// room for this page and for the kernel's own allocations.
+// Returns 0 if memory is exhausted.  May sleep.
+char*
+swapalloc(void)
+{
+  while(kfreecount() < SWAPLOW && swapout(SWAPBATCH) > 0)
+    ;
+  return kalloc_zeroed();
+}
+
+// Read back the page at va of p, whose entry is the PTE_SWAP
+// entry e, and map it.  Returns 0 on success, -1 if memory is
+// exhausted.
+int
+swapin(struct proc *p, uint va, pte_t e)
+{
+  char *mem;
+  int r;
+
+  if((mem = swapalloc()) == 0)
+    return -1;
+  acquiresleep(&swap.io);
+  swaprw(mem, PTE_SLOT(e), 0);
+  releasesleep(&swap.io);
+  // Another thread may have brought it in while we slept.
+  if((r = uvmmap(p, va, mem, e & (PTE_U|PTE_W), e)) <= 0){
+    if(r < 0)
+      kfree(mem);
+    return r;
+  }
+  swapfree(PTE_SLOT(e));
+
+  acquire(&swap.lock);
+  swap.nin++;
+  release(&swap.lock);
+  return 0;
+}
+
+void
+swapstat(struct swapstat *st)
+{
+  uint i, n;
+
+  n = swapslots();
+  acquire(&swap.lock);
+  st->nin = swap.nin;
+  st->nout = swap.nout;
+  st->used = 0;
+  for(i = 0; i < n; i++)
+    if(swap.ref[i])
+      st->used++;
+  release(&swap.lock);
+  st->total = n;
+  st->freemem = kfreecount();
+}
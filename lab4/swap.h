@@ -0,0 +1,8 @@
+// Paging statistics, filled in by the swapstat system call.
+struct swapstat {
+  uint nin;       // pages read back from swap since boot
+  uint nout;      // pages written to swap since boot
+  uint used;      // swap slots in use
+  uint total;     // swap slots
+  uint freemem;   // free pages of physical memory
+};
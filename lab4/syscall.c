@@ -13,13 +13,31 @@
 // library system call function. The saved user %esp points
 // to a saved program counter, and then the first argument.
 
+// Return the end of the region of p's memory that holds addr:
+// p->sz for the program image and heap, the end of the mapping
+// for mmap() regions.  Returns 0 if addr is not valid.
+static uint
+userend(struct proc *p, uint addr)
+{
+  struct vma *v;
+
+  if(addr < p->sz)
+    return p->sz;
+  if((v = vmalookup(p, addr)) != 0)
+    return v->end;
+  return 0;
+}
+
 // Fetch the int at addr from the current process.
 int
 fetchint(uint addr, int *ip)
 {
   struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz || addr+4 > curproc->sz)
+  if(addr+4 < addr || pin(curproc, addr, addr+4) < 0 ||
+     addr+4 > userend(curproc, addr))
+    return -1;
+  if(uvmfault(curproc, addr, 0) < 0 || uvmfault(curproc, addr+3, 0) < 0)
     return -1;
   *ip = *(int*)(addr);
   return 0;
@@ -34,11 +52,15 @@ fetchstr(uint addr, char **pp)
   char *s, *ep;
   struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz)
+  if((ep = (char*)userend(curproc, addr)) == 0)
     return -1;
   *pp = (char*)addr;
-  ep = (char*)curproc->sz;
   for(s = *pp; s < ep; s++){
+    if((s == *pp || (uint)s % PGSIZE == 0) &&
+       (pin(curproc, (uint)s, PGROUNDUP((uint)s + 1)) < 0 ||
+        (uint)s >= userend(curproc, (uint)s) ||
+        uvmfault(curproc, (uint)s, 0) < 0))
+      return -1;
     if(*s == 0)
       return s - *pp;
   }
@@ -52,27 +74,52 @@ argint(int n, int *ip)
   return fetchint((myproc()->tf->esp) + 4 + 4*n, ip);
 }
 
-// Fetch the nth word-sized system call argument as a pointer
-// to a block of memory of size bytes.  Check that the pointer
-// lies within the process address space.
-int
-argptr(int n, char **pp, int size)
+// Fetch the nth argument as a pointer to size bytes of user
+// memory and back the whole buffer with pages now, so the kernel
+// never faults on it while holding locks.
+static int
+argbuf(int n, char **pp, int size, int write)
 {
   int i;
+  uint a;
   struct proc *curproc = myproc();
  
   if(argint(n, &i) < 0)
     return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  // Keep the buffer in place until the system call returns:
+  // the kernel may use it holding a spinlock, when it must not
+  // fault.
+  if(size < 0 || (uint)i+size < (uint)i || pin(curproc, i, i+size) < 0 ||
+     (uint)i+size > userend(curproc, i))
     return -1;
+  for(a = PGROUNDDOWN((uint)i); a < (uint)i+size; a += PGSIZE)
+    if(uvmfault(curproc, a, write) < 0)
+      return -1;
   *pp = (char*)i;
   return 0;
 }
 
+// Fetch the nth word-sized system call argument as a pointer
+// to a block of memory of size bytes.  Check that the pointer
+// lies within the process address space.
+int
+argptr(int n, char **pp, int size)
+{
+  return argbuf(n, pp, size, 0);
+}
+
+// Like argptr, but for a buffer the kernel is going to write
+// into, which must not be read-only (e.g. shared text).
+int
+argoutptr(int n, char **pp, int size)
+{
+  return argbuf(n, pp, size, 1);
+}
+
 // Fetch the nth word-sized system call argument as a string pointer.
 // Check that the pointer is valid and the string is nul-terminated.
-// (There is no shared writable memory, so the string can't change
-// between this check and being used by the kernel.)
+// (A string in a MAP_SHARED region can still be changed by another
+// process after this check.)
 int
 argstr(int n, char **pp)
 {
@@ -108,6 +155,14 @@ extern int sys_sem_acquire(void);
 extern int sys_sem_release(void);
 extern int sys_pickup(void);
 extern int sys_putdown(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_shm_open(void);
+extern int sys_shm_close(void);
+extern int sys_swapstat(void);
+extern int sys_clone(void);
+extern int sys_join(void);
+extern int sys_fsync(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -136,6 +191,14 @@ static int (*syscalls[])(void) = {
 [SYS_sem_release] sys_sem_release,
 [SYS_pickup] sys_pickup,
 [SYS_putdown] sys_putdown,
+[SYS_mmap] sys_mmap,
+[SYS_munmap] sys_munmap,
+[SYS_shm_open] sys_shm_open,
+[SYS_shm_close] sys_shm_close,
+[SYS_swapstat] sys_swapstat,
+[SYS_clone] sys_clone,
+[SYS_join] sys_join,
+[SYS_fsync] sys_fsync,
 };
 
 void
@@ -147,6 +210,7 @@ syscall(void)
   num = curproc->tf->eax;
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
     curproc->tf->eax = syscalls[num]();
+    curproc->pinstart = curproc->pinend = 0;
   } else {
     cprintf("%d %s: unknown sys call %d\n",
             curproc->pid, curproc->name, num);
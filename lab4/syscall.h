@@ -26,3 +26,11 @@
 #define SYS_sem_release 24
 #define SYS_pickup 25
 #define SYS_putdown 26
+#define SYS_mmap 27
+#define SYS_munmap 28
+#define SYS_shm_open 29
+#define SYS_shm_close 30
+#define SYS_swapstat 31
+#define SYS_clone 32
+#define SYS_join 33
+#define SYS_fsync 34
@@ -2,6 +2,7 @@
 #include "x86.h"
 #include "defs.h"
 #include "date.h"
+#include "swap.h"
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
@@ -45,15 +46,11 @@ sys_getpid(void)
 int
 sys_sbrk(void)
 {
-  int addr;
   int n;
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
-    return -1;
-  return addr;
+  return growproc(n);
 }
 
 int
@@ -143,4 +140,58 @@ sys_putdown(void)
   argint(0, &i);
 
   return putdown(philosofer_num, i);
-}
\ No newline at end of file
+}
+
+int
+sys_shm_open(void)
+{
+  char *name;
+  int size, addr;
+
+  if(argstr(0, &name) < 0 || argint(1, &size) < 0 || argint(2, &addr) < 0)
+    return -1;
+  if(size < 0)
+    return -1;
+  return shm_open(name, size, addr);
+}
+
+int
+sys_shm_close(void)
+{
+  int addr;
+
+  if(argint(0, &addr) < 0)
+    return -1;
+  return shm_close(addr);
+}
+
+int
+sys_swapstat(void)
+{
+  struct swapstat *st;
+
+  if(argoutptr(0, (void*)&st, sizeof(*st)) < 0)
+    return -1;
+  swapstat(st);
+  return 0;
+}
+
+int
+sys_clone(void)
+{
+  int fn, arg, stack;
+
+  if(argint(0, &fn) < 0 || argint(1, &arg) < 0 || argint(2, &stack) < 0)
+    return -1;
+  return clone(fn, arg, stack);
+}
+
+int
+sys_join(void)
+{
+  uint *stack;
+
+  if(argoutptr(0, (void*)&stack, sizeof(*stack)) < 0)
+    return -1;
+  return join(stack);
+}
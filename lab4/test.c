@@ -2,8 +2,38 @@
 #include "user.h"
 #include "stat.h"
 
+// The dining philosophers, one thread each.  Same as running
+// "phil 0" .. "phil 4", but the threads share one address space,
+// so none of them needs a fork() and exec() of its own.
+
+void philosopher(void *arg)
+{
+    int i = (int)arg;
+    int odd = (i % 3) % 2;
+
+    while (1) {
+        printf(1, "Philosopher %d State: THINK\n", i);
+        sleep(100);
+        printf(1, "Philosopher %d State: HUNGRY\n", i);
+
+        if (odd) {
+            sem_acquire(i);
+            sem_acquire((i+4) % 5);
+        }
+        else {
+            sem_acquire((i+4) % 5);
+            sem_acquire(i);
+        }
+
+        printf(1, "Philosopher %d State: EAT\n", i);
+        sleep(100);
+        printf(1, "Philosopher %d State: FINISH\n", i);
+
+        sem_release(i);
+        sem_release((i+4) % 5);
+    }
+}
 
- 
 int main()
 {
     for (int i = 0; i < 5; i++){
@@ -11,18 +41,12 @@ int main()
     }
 
     for (int i = 0; i < 5; i++) {
-        char id[] = {i+'0', '\0'};
-        char *args[] = {
-            "phil", 
-            id, 
-            '\0'
-        };
-
-        int pid = fork();
-        if (pid==0) {
-            exec("phil", args);
+        if (thread_create(philosopher, (void*)i) < 0) {
+            printf(2, "test: thread_create failed\n");
             exit();
         }
     }
-    return 0;
-}
\ No newline at end of file
+    while (thread_join() >= 0)
+        ;
+    exit();
+}
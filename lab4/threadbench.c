@@ -0,0 +1,85 @@
+// Thread creation benchmark.
+//
+// Compares the cycles it takes to start a worker and wait for it
+// to finish, for a thread (thread_create + thread_join), a forked
+// process (fork + wait), and a new program (fork + exec + wait, as
+// the dining philosophers demo used to start each philosopher).
+// Run with an optional count:
+//    threadbench [n]
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+static uint
+rdtsc(void)
+{
+  uint lo, hi;
+
+  asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+  return lo;
+}
+
+void
+worker(void *arg)
+{
+  exit();
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *args[] = { "threadbench", "-x", 0 };
+  int n, i, pid;
+  uint t0, tthread, tfork, texec;
+
+  // The program fork+exec starts: exit at once.
+  if(argc > 1 && strcmp(argv[1], "-x") == 0)
+    exit();
+
+  n = 100;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n <= 0)
+    n = 1;
+
+  t0 = rdtsc();
+  for(i = 0; i < n; i++){
+    if(thread_create(worker, 0) < 0 || thread_join() < 0){
+      printf(2, "threadbench: thread failed\n");
+      exit();
+    }
+  }
+  tthread = (rdtsc() - t0) / n;
+
+  t0 = rdtsc();
+  for(i = 0; i < n; i++){
+    if((pid = fork()) < 0){
+      printf(2, "threadbench: fork failed\n");
+      exit();
+    }
+    if(pid == 0)
+      exit();
+    wait();
+  }
+  tfork = (rdtsc() - t0) / n;
+
+  t0 = rdtsc();
+  for(i = 0; i < n; i++){
+    if((pid = fork()) < 0){
+      printf(2, "threadbench: fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      exec(args[0], args);
+      printf(2, "threadbench: exec failed\n");
+      exit();
+    }
+    wait();
+  }
+  texec = (rdtsc() - t0) / n;
+
+  printf(1, "threadbench: %d cycles per thread, %d per fork, %d per fork+exec\n",
+         tthread, tfork, texec);
+  exit();
+}
@@ -78,8 +78,31 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
 
+  case T_DEVICE:
+    fputrap();
+    break;
+
+  case T_IPI:
+    ipiintr();
+    lapiceoi();
+    break;
+
+  case T_PGFLT:
+    // Not-present faults below p->sz are pages of the program or
+    // heap that have not been touched yet.
+    if(myproc() != 0 && (tf->err & FEC_PR) == 0 &&
+       uvmfault(myproc(), rcr2(), tf->err & FEC_WR) == 0)
+      break;
+    // fall through
+
   //PAGEBREAK: 13
   default:
+    // The IRQ of a PCI device is only known at boot.
+    if(virtioirq && tf->trapno == T_IRQ0 + virtioirq){
+      virtiointr();
+      lapiceoi();
+      break;
+    }
     if(myproc() == 0 || (tf->cs&3) == 0){
       // In kernel, it must be our mistake.
       cprintf("unexpected trap %d from cpu %d eip %x (cr2=0x%x)\n",
@@ -33,13 +33,50 @@ strlen(const char *s)
   return n;
 }
 
+// memset, memcmp and memmove work a word at a time, and memmove
+// uses SSE for big copies if the CPU has it.  The kernel saves each
+// process's SSE registers, so user code is free to use them.
+
 void*
 memset(void *dst, int c, uint n)
 {
-  stosb(dst, c, n);
+  char *d;
+  uint m;
+
+  d = dst;
+  c &= 0xFF;
+  if(n >= 16){
+    m = -(uint)d % 4;
+    stosb(d, c, m);
+    d += m;
+    n -= m;
+    stosl(d, (c<<24)|(c<<16)|(c<<8)|c, n/4);
+    d += n & ~3;
+    n %= 4;
+  }
+  stosb(d, c, n);
   return dst;
 }
 
+int
+memcmp(const void *v1, const void *v2, uint n)
+{
+  const uchar *s1, *s2;
+
+  s1 = v1;
+  s2 = v2;
+  while(n >= 4 && *(uint*)s1 == *(uint*)s2){
+    s1 += 4, s2 += 4;
+    n -= 4;
+  }
+  while(n-- > 0){
+    if(*s1 != *s2)
+      return *s1 - *s2;
+    s1++, s2++;
+  }
+  return 0;
+}
+
 char*
 strchr(const char *s, char c)
 {
@@ -92,15 +129,127 @@ atoi(const char *s)
   return n;
 }
 
+// Does the CPU have SSE2 (for movdqu)?
+static int
+hassse2(void)
+{
+  static int sse2 = -1;
+  uint a, b, c, d;
+
+  if(sse2 < 0){
+    asm volatile("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (1));
+    sse2 = (d >> 26) & 1;
+  }
+  return sse2;
+}
+
+// Copy n bytes, a multiple of 64, 64 bytes at a time.  Built for
+// SSE2 so that the compiler knows the xmm registers it clobbers.
+__attribute__((target("sse2"))) static void
+ssecopy(char *dst, const char *src, uint n)
+{
+  asm volatile("1:\n\t"
+               "movdqu (%1), %%xmm0\n\t"
+               "movdqu 16(%1), %%xmm1\n\t"
+               "movdqu 32(%1), %%xmm2\n\t"
+               "movdqu 48(%1), %%xmm3\n\t"
+               "movdqu %%xmm0, (%0)\n\t"
+               "movdqu %%xmm1, 16(%0)\n\t"
+               "movdqu %%xmm2, 32(%0)\n\t"
+               "movdqu %%xmm3, 48(%0)\n\t"
+               "add $64, %1\n\t"
+               "add $64, %0\n\t"
+               "sub $64, %2\n\t"
+               "jnz 1b" :
+               "+r" (dst), "+r" (src), "+r" (n) : :
+               "memory", "cc", "xmm0", "xmm1", "xmm2", "xmm3");
+}
+
 void*
 memmove(void *vdst, const void *vsrc, int n)
 {
   char *dst;
   const char *src;
+  uint m;
 
   dst = vdst;
   src = vsrc;
-  while(n-- > 0)
-    *dst++ = *src++;
+  if(n <= 0)
+    return vdst;
+  if(src < dst && src + n > dst){
+    // Overlapping with dst above src: copy from the top down.
+    dst += n;
+    src += n;
+    while(n-- > 0)
+      *--dst = *--src;
+    return vdst;
+  }
+  if(n >= 16){
+    m = -(uint)dst % 4;
+    movsb(dst, src, m);
+    dst += m;
+    src += m;
+    n -= m;
+    if(n >= 256 && hassse2()){
+      m = n & ~63;
+      ssecopy(dst, src, m);
+      dst += m;
+      src += m;
+      n -= m;
+    }
+    movsl(dst, src, n/4);
+    dst += n & ~3;
+    src += n & ~3;
+    n %= 4;
+  }
+  movsb(dst, src, n);
   return vdst;
 }
+
+// Threads.  thread_create runs fn(arg) in a new thread of this
+// process, on a one-page stack from malloc; fn must end by calling
+// exit().  thread_join waits for one of the threads to exit, frees
+// its stack and returns its pid.
+int
+thread_create(void (*fn)(void*), void *arg)
+{
+  void *stack;
+  int pid;
+
+  if((stack = malloc(4096)) == 0)
+    return -1;
+  if((pid = clone(fn, arg, stack)) < 0)
+    free(stack);
+  return pid;
+}
+
+int
+thread_join(void)
+{
+  void *stack;
+  int pid;
+
+  if((pid = join(&stack)) >= 0)
+    free(stack);
+  return pid;
+}
+
+// Spin locks for threads.
+void
+lock_init(struct lock *lk)
+{
+  lk->locked = 0;
+}
+
+void
+lock_acquire(struct lock *lk)
+{
+  while(xchg(&lk->locked, 1) != 0)
+    ;
+}
+
+void
+lock_release(struct lock *lk)
+{
+  xchg(&lk->locked, 0);
+}
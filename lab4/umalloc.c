@@ -2,89 +2,158 @@
 #include "stat.h"
 #include "user.h"
 #include "param.h"
+#include "mman.h"
+#include "x86.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Size-class memory allocator.
+//
+// Requests of up to MAXSMALL bytes are rounded up to a power of
+// two and served from that size class.  Each class keeps a list
+// of freed blocks, so malloc and free of small blocks are O(1):
+// malloc pops the list or carves a new block off the current
+// arena with a bump pointer, and free pushes the block back.
+// Arenas come from sbrk, ARENA bytes at a time.
+//
+// Larger requests get their own anonymous mmap(), which free()
+// unmaps.  If mmap() fails (a process has only NVMA mappings) they
+// come from sbrk instead and are kept on a list for reuse.
+//
+// A spin lock keeps the lists consistent if threads share them.
 
-typedef long Align;
+#define NCLASS   13                    // block sizes 16 .. 64KB
+#define MAXSMALL ((16 << (NCLASS-1)) - sizeof(Header))
+#define ARENA    (64*1024)
+#define LARGE    NCLASS                // hdr.cls of large blocks
 
+typedef union header Header;
+
+// 16 bytes, so blocks stay 16-byte aligned.
 union header {
   struct {
-    union header *ptr;
-    uint size;
+    uint cls;      // size class, or LARGE
+    uint size;     // LARGE: bytes in the block, header included
+    Header *next;  // on a free list: next free block
+    uint mapped;   // LARGE: 1 if from mmap(), 0 if from sbrk()
   } s;
-  Align x;
+  long long align;
 };
 
-typedef union header Header;
-
-static Header base;
-static Header *freep;
+static Header *freelist[NCLASS];
+static Header *largefree;       // sbrk()ed large blocks not in use
+static char *arena, *arenaend;  // unused part of the current arena
+static uint lock;
 
-void
-free(void *ap)
+static void
+acquire(void)
 {
-  Header *bp, *p;
+  while(xchg(&lock, 1) != 0)
+    ;
+}
 
-  bp = (Header*)ap - 1;
-  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if(bp + bp->s.size == p->s.ptr){
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if(p + p->s.size == bp){
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
-  } else
-    p->s.ptr = bp;
-  freep = p;
+static void
+release(void)
+{
+  xchg(&lock, 0);
 }
 
+// Carve n bytes off the arena, starting a new one if needed.
 static Header*
-morecore(uint nu)
+bump(uint n)
+{
+  char *p;
+  uint grow;
+
+  if(arena + n > arenaend){
+    grow = n > ARENA ? n : ARENA;
+    p = sbrk(grow + 15);
+    if(p == (char*)-1)
+      return 0;
+    if(p != arenaend){
+      // Someone else moved the break; start afresh.
+      arena = (char*)(((uint)p + 15) & ~15);
+    }
+    arenaend = p + grow + 15;
+  }
+  p = arena;
+  arena += n;
+  return (Header*)p;
+}
+
+static void*
+largealloc(uint nbytes)
 {
+  Header *h, **pp;
+  uint n;
   char *p;
-  Header *hp;
 
-  if(nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
-  if(p == (char*)-1)
+  n = (nbytes + sizeof(Header) + 4095) & ~4095;
+  if(n < nbytes)
     return 0;
-  hp = (Header*)p;
-  hp->s.size = nu;
-  free((void*)(hp + 1));
-  return freep;
+  p = mmap(0, n, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(p != (char*)-1){
+    h = (Header*)p;
+    h->s.mapped = 1;
+  } else {
+    acquire();
+    for(pp = &largefree; *pp; pp = &(*pp)->s.next)
+      if((*pp)->s.size >= n)
+        break;
+    if((h = *pp) != 0){
+      *pp = h->s.next;
+      n = h->s.size;
+    } else
+      h = bump(n);
+    release();
+    if(h == 0)
+      return 0;
+    h->s.mapped = 0;
+  }
+  h->s.cls = LARGE;
+  h->s.size = n;
+  return (char*)h + sizeof(Header);
 }
 
 void*
 malloc(uint nbytes)
 {
-  Header *p, *prevp;
-  uint nunits;
+  Header *h;
+  uint c;
+
+  if(nbytes > MAXSMALL)
+    return largealloc(nbytes);
+  for(c = 0; (16 << c) < nbytes + sizeof(Header); c++)
+    ;
+  acquire();
+  if((h = freelist[c]) != 0)
+    freelist[c] = h->s.next;
+  else
+    h = bump(16 << c);
+  release();
+  if(h == 0)
+    return 0;
+  h->s.cls = c;
+  return (char*)h + sizeof(Header);
+}
+
+void
+free(void *ap)
+{
+  Header *h;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-  if((prevp = freep) == 0){
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
+  if(ap == 0)
+    return;
+  h = (Header*)((char*)ap - sizeof(Header));
+  if(h->s.cls == LARGE && h->s.mapped){
+    munmap((char*)h, h->s.size);
+    return;
   }
-  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
-    if(p->s.size >= nunits){
-      if(p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
-      }
-      freep = prevp;
-      return (void*)(p + 1);
-    }
-    if(p == freep)
-      if((p = morecore(nunits)) == 0)
-        return 0;
+  acquire();
+  if(h->s.cls == LARGE){
+    h->s.next = largefree;
+    largefree = h;
+  } else {
+    h->s.next = freelist[h->s.cls];
+    freelist[h->s.cls] = h;
   }
+  release();
 }
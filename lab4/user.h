@@ -1,5 +1,11 @@
 struct stat;
 struct rtcdate;
+struct swapstat;
+
+// A spin lock for threads (see ulib.c).
+struct lock {
+  uint locked;
+};
 
 // system calls
 int fork(void);
@@ -28,6 +34,14 @@ int sem_acquire(int);
 int sem_release(int);
 int pickup(int); // fork id
 int putdown(int);
+char* mmap(char*, int, int, int, int, int);
+int munmap(char*, int);
+char* shm_open(char*, int, char*);
+int shm_close(char*);
+int swapstat(struct swapstat*);
+int clone(void(*)(void*), void*, void*);
+int join(void**);
+int fsync(int);
 
 
 // ulib.c
@@ -40,6 +54,12 @@ void printf(int, const char*, ...);
 char* gets(char*, int max);
 uint strlen(const char*);
 void* memset(void*, int, uint);
+int memcmp(const void*, const void*, uint);
 void* malloc(uint);
 void free(void*);
 int atoi(const char*);
+int thread_create(void(*)(void*), void*);
+int thread_join(void);
+void lock_init(struct lock*);
+void lock_acquire(struct lock*);
+void lock_release(struct lock*);
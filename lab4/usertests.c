@@ -7,6 +7,8 @@
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
+#include "mman.h"
+#include "swap.h"
 
 char buf[8192];
 char name[3];
@@ -184,6 +186,9 @@ writetest(void)
   printf(stdout, "small file test ok\n");
 }
 
+// Blocks in the big file: into the double-indirect ones.
+#define NBIG (NDIRECT + NINDIRECT + 2*NINDIRECT)
+
 void
 writetest1(void)
 {
@@ -197,7 +202,7 @@ writetest1(void)
     exit();
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < NBIG; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, 512) != 512){
       printf(stdout, "error: write big file failed\n", i);
@@ -217,7 +222,7 @@ writetest1(void)
   for(;;){
     i = read(fd, buf, 512);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != NBIG){
         printf(stdout, "read only %d blocks from big", n);
         exit();
       }
@@ -1546,6 +1551,981 @@ sbrktest(void)
   printf(stdout, "sbrk test OK\n");
 }
 
+// does sbrk() hand out address space without allocating it up
+// front, and do untouched heap pages read as zero from user code,
+// from the kernel, and in a forked child?
+void
+lazysbrktest(void)
+{
+  char *a, *p;
+  int fd, i, pid;
+  uint amt;
+
+  printf(stdout, "lazy sbrk test\n");
+  amt = 64*1024*1024;
+  a = sbrk(amt);
+  if(a == (char*)0xffffffff){
+    printf(stdout, "lazy sbrk test: sbrk failed\n");
+    exit();
+  }
+  for(p = a; p < a + amt; p += 4*1024*1024){
+    if(*p != 0){
+      printf(stdout, "lazy sbrk test: page not zero\n");
+      exit();
+    }
+    *p = 1;
+  }
+
+  // the kernel reads from and writes to pages nobody touched yet
+  fd = open("lazysbrk", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "lazy sbrk test: create failed\n");
+    exit();
+  }
+  if(write(fd, a + 3*4096, 100) != 100){
+    printf(stdout, "lazy sbrk test: write failed\n");
+    exit();
+  }
+  close(fd);
+  fd = open("lazysbrk", O_RDONLY);
+  if(read(fd, a + amt - 100, 100) != 100){
+    printf(stdout, "lazy sbrk test: read failed\n");
+    exit();
+  }
+  close(fd);
+  unlink("lazysbrk");
+  for(i = 0; i < 100; i++){
+    if(a[amt - 100 + i] != 0){
+      printf(stdout, "lazy sbrk test: read back garbage\n");
+      exit();
+    }
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "lazy sbrk test: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if(a[0] != 1 || a[4096] != 0){
+      printf(stdout, "lazy sbrk test: child sees wrong heap\n");
+      exit();
+    }
+    exit();
+  }
+  wait();
+
+  if(sbrk(-amt) == (char*)0xffffffff){
+    printf(stdout, "lazy sbrk test: shrink failed\n");
+    exit();
+  }
+  printf(stdout, "lazy sbrk test ok\n");
+}
+
+// a big heap may be backed by 4MB superpages: every page must
+// still start out zero, survive fork(), and a shrink that ends
+// in the middle of a superpage must keep the pages below it.
+void
+bigpagetest(void)
+{
+  char *a, *p;
+  uint amt, cut;
+  int pid;
+
+  printf(stdout, "big page test\n");
+  amt = 12*1024*1024;
+  a = sbrk(amt);
+  if(a == (char*)0xffffffff){
+    printf(stdout, "big page test: sbrk failed\n");
+    exit();
+  }
+  for(p = a; p < a + amt; p += 4096){
+    if(*p != 0){
+      printf(stdout, "big page test: page not zero\n");
+      exit();
+    }
+    *p = (uint)p >> 12;
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "big page test: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    for(p = a; p < a + amt; p += 4096){
+      if(*p != (char)((uint)p >> 12)){
+        printf(stdout, "big page test: child sees wrong heap\n");
+        exit();
+      }
+    }
+    exit();
+  }
+  wait();
+
+  cut = amt / 2 + 5*4096;
+  if(sbrk(-cut) == (char*)0xffffffff){
+    printf(stdout, "big page test: shrink failed\n");
+    exit();
+  }
+  for(p = a; p < a + amt - cut; p += 4096){
+    if(*p != (char)((uint)p >> 12)){
+      printf(stdout, "big page test: shrink lost a page\n");
+      exit();
+    }
+  }
+  if(sbrk(cut) == (char*)0xffffffff){
+    printf(stdout, "big page test: regrow failed\n");
+    exit();
+  }
+  for(p = a + amt - cut; p < a + amt; p += 4096){
+    if(*p != 0){
+      printf(stdout, "big page test: regrown page not zero\n");
+      exit();
+    }
+  }
+  sbrk(-amt);
+  printf(stdout, "big page test ok\n");
+}
+
+// is program text mapped read-only now that it can be
+// shared with other processes through the page cache?
+void
+texttest(void)
+{
+  int fd, pid;
+  char *text;
+
+  printf(stdout, "text test\n");
+  text = (char*)texttest;
+
+  fd = open("README", O_RDONLY);
+  if(fd < 0){
+    printf(stdout, "text test: open README failed\n");
+    exit();
+  }
+  if(read(fd, text, 10) != -1){
+    printf(stdout, "text test: read() into text succeeded\n");
+    exit();
+  }
+  close(fd);
+
+  unlink("text-writable");
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "text test: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    *text = 0;
+    close(open("text-writable", O_CREATE|O_RDWR));
+    exit();
+  }
+  wait();
+  if(open("text-writable", O_RDONLY) >= 0){
+    printf(stdout, "text test: text is writable\n");
+    unlink("text-writable");
+    exit();
+  }
+  printf(stdout, "text test ok\n");
+}
+
+// file-backed and anonymous mmap(): shared stores reach the
+// file, private stores do not, and fork() shares MAP_SHARED pages.
+void
+mmaptest(void)
+{
+  int fd, i, pid;
+  char *p, *q;
+
+  printf(stdout, "mmap test\n");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "mmap test: create failed\n");
+    exit();
+  }
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = 'a' + i % 26;
+  if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf(stdout, "mmap test: write failed\n");
+    exit();
+  }
+
+  p = mmap(0, sizeof(buf), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  q = mmap(0, sizeof(buf), PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1 || q == (char*)-1){
+    printf(stdout, "mmap test: mmap failed\n");
+    exit();
+  }
+  for(i = 0; i < sizeof(buf); i++){
+    if(p[i] != buf[i] || q[i] != buf[i]){
+      printf(stdout, "mmap test: wrong contents at %d\n", i);
+      exit();
+    }
+  }
+  p[0] = 'X';
+  q[1] = 'Y';
+  p[sizeof(buf)-1] = 'Z';
+  if(munmap(p, sizeof(buf)) < 0 || munmap(q, sizeof(buf)) < 0){
+    printf(stdout, "mmap test: munmap failed\n");
+    exit();
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf(stdout, "mmap test: read back failed\n");
+    exit();
+  }
+  close(fd);
+  unlink("mmapfile");
+  if(buf[0] != 'X' || buf[1] != 'b' || buf[sizeof(buf)-1] != 'Z'){
+    printf(stdout, "mmap test: shared stores not written back\n");
+    exit();
+  }
+
+  // A store through the child's mapping must reach the file when
+  // the parent, which never stored, unmaps the page last.
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf(stdout, "mmap test: write failed\n");
+    exit();
+  }
+  p = mmap(0, sizeof(buf), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1 || p[0] != 'X'){
+    printf(stdout, "mmap test: mmap failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "mmap test: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    p[2] = 'W';
+    exit();
+  }
+  wait();
+  munmap(p, sizeof(buf));
+  close(fd);
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, sizeof(buf)) != sizeof(buf) || buf[2] != 'W'){
+    printf(stdout, "mmap test: child's shared store not written back\n");
+    exit();
+  }
+  close(fd);
+  unlink("mmapfile");
+
+  p = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(p == (char*)-1 || p[0] != 0){
+    printf(stdout, "mmap test: anonymous mmap failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "mmap test: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    p[0] = 42;
+    exit();
+  }
+  wait();
+  if(p[0] != 42){
+    printf(stdout, "mmap test: child store not shared\n");
+    exit();
+  }
+  munmap(p, 4096);
+  printf(stdout, "mmap test ok\n");
+}
+
+// Each child keeps values in x87 and SSE registers while the
+// others run, so lost or mixed-up FPU state shows up as a wrong
+// result.
+void
+fputest(void)
+{
+  uint in[4], out[4];
+  volatile double x;
+  double y;
+  int i, j, k, pid;
+
+  printf(stdout, "fpu test\n");
+  for(i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf(stdout, "fpu test: fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      for(j = 0; j < 4; j++)
+        in[j] = i*0x01010101 + j;
+      asm volatile("movdqu %0, %%xmm1" : : "m" (in));
+      for(k = 0; k < 10; k++){
+        // y stays in an x87 register across timer interrupts.
+        y = i;
+        for(j = 0; j < 1000000; j++)
+          y += 1.0;
+        x = y;
+        if(x != i + 1000000){
+          printf(stdout, "fpu test: x87 state lost\n");
+          exit();
+        }
+        sleep(1);
+      }
+      asm volatile("movdqu %%xmm1, %0" : "=m" (out));
+      for(j = 0; j < 4; j++){
+        if(out[j] != in[j]){
+          printf(stdout, "fpu test: sse state lost\n");
+          exit();
+        }
+      }
+      exit();
+    }
+  }
+  for(i = 0; i < 4; i++)
+    wait();
+  printf(stdout, "fpu test ok\n");
+}
+
+// named shared memory: a fresh attachment in another process sees
+// the same pages, a fork()ed attachment too, and the segment goes
+// away with its last attachment.
+void
+shmtest(void)
+{
+  char *p, *q;
+  int pid;
+
+  printf(stdout, "shm test\n");
+  p = shm_open("shmtest", 2*4096, (char*)0x60000000);
+  if(p != (char*)0x60000000){
+    printf(stdout, "shm test: shm_open failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "shm test: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    p[0] = 1;
+    if(shm_close(p) < 0){
+      printf(stdout, "shm test: shm_close failed\n");
+      exit();
+    }
+    q = shm_open("shmtest", 0, 0);
+    if(q == (char*)-1){
+      printf(stdout, "shm test: second shm_open failed\n");
+      exit();
+    }
+    q[4096+100] = 2;
+    exit();
+  }
+  wait();
+  if(p[0] != 1 || p[4096+100] != 2){
+    printf(stdout, "shm test: stores not shared\n");
+    exit();
+  }
+  if(shm_open("shmtest", 3*4096, 0) != (char*)-1){
+    printf(stdout, "shm test: grew an existing segment\n");
+    exit();
+  }
+  if(shm_close(p) < 0){
+    printf(stdout, "shm test: shm_close failed\n");
+    exit();
+  }
+  p = shm_open("shmtest", 4096, 0);
+  if(p == (char*)-1 || p[0] != 0){
+    printf(stdout, "shm test: segment outlived its attachments\n");
+    exit();
+  }
+  shm_close(p);
+  printf(stdout, "shm test ok\n");
+}
+
+// Grow the heap by n pages, a few at a time so that they do not
+// become superpages, and write each page's number into it.
+char*
+swapfill(int n)
+{
+  char *a, *p;
+  int i;
+
+  a = sbrk(0);
+  for(i = 0; i < n; i++){
+    if(i % 16 == 0 && sbrk(16*4096) == (char*)0xffffffff)
+      return 0;
+    p = a + i*4096;
+    *(int*)p = i;
+  }
+  return a;
+}
+
+int
+swapcheck(char *a, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    if(*(int*)(a + i*4096) != i)
+      return -1;
+  return 0;
+}
+
+struct lock threadlock;
+int threadcount;
+volatile int threadstop;
+char *threadheap;
+
+void
+threadadd(void *arg)
+{
+  int i;
+
+  for(i = 0; i < 1000; i++){
+    lock_acquire(&threadlock);
+    threadcount += (int)arg;
+    lock_release(&threadlock);
+  }
+  exit();
+}
+
+void
+threadgrow(void *arg)
+{
+  threadheap = sbrk(8*4096);
+  if(threadheap != (char*)0xffffffff)
+    threadheap[5*4096] = 'x';
+  exit();
+}
+
+void
+threadspin(void *arg)
+{
+  while(!threadstop)
+    ;
+  exit();
+}
+
+// Threads share memory, see each other's sbrk(), and are reaped
+// by join(); shrinking the heap while a thread runs elsewhere
+// must not disturb it.
+void
+threadtest(void)
+{
+  int i, pid;
+  char *a;
+
+  printf(stdout, "thread test\n");
+  if(thread_join() != -1){
+    printf(stdout, "thread test: join without threads\n");
+    exit();
+  }
+
+  lock_init(&threadlock);
+  threadcount = 0;
+  for(i = 0; i < 4; i++){
+    if(thread_create(threadadd, (void*)(i+1)) < 0){
+      printf(stdout, "thread test: thread_create failed\n");
+      exit();
+    }
+  }
+  for(i = 0; i < 4; i++){
+    if(thread_join() < 0){
+      printf(stdout, "thread test: join failed\n");
+      exit();
+    }
+  }
+  if(threadcount != 1000*(1+2+3+4)){
+    printf(stdout, "thread test: count %d\n", threadcount);
+    exit();
+  }
+
+  thread_create(threadgrow, 0);
+  thread_join();
+  a = threadheap;
+  if(a == (char*)0xffffffff || a[5*4096] != 'x' || sbrk(0) != a + 8*4096){
+    printf(stdout, "thread test: sbrk not shared\n");
+    exit();
+  }
+
+  threadstop = 0;
+  pid = thread_create(threadspin, 0);
+  a[6*4096] = 'y';
+  if(sbrk(-8*4096) != a + 8*4096){
+    printf(stdout, "thread test: shrink failed\n");
+    exit();
+  }
+  threadstop = 1;
+  if(thread_join() != pid){
+    printf(stdout, "thread test: wrong thread joined\n");
+    exit();
+  }
+  if(wait() != -1){
+    printf(stdout, "thread test: wait() saw a thread\n");
+    exit();
+  }
+  printf(stdout, "thread test ok\n");
+}
+
+// Read a file sequentially through two descriptors in turn, in
+// chunks that straddle blocks, while the blocks ahead of each are
+// being read in the background.
+void
+readaheadtest(void)
+{
+  int fd, fd1, fd2, i, n;
+  uint off1, off2;
+
+  printf(stdout, "readahead test\n");
+  unlink("ra");
+  if((fd = open("ra", O_CREATE|O_RDWR)) < 0){
+    printf(stdout, "readahead test: create failed\n");
+    exit();
+  }
+  for(i = 0; i < 100; i++){
+    memset(buf, i, 512);
+    if(write(fd, buf, 512) != 512){
+      printf(stdout, "readahead test: write failed\n");
+      exit();
+    }
+  }
+  close(fd);
+
+  fd1 = open("ra", O_RDONLY);
+  fd2 = open("ra", O_RDONLY);
+  if(fd1 < 0 || fd2 < 0){
+    printf(stdout, "readahead test: open failed\n");
+    exit();
+  }
+  off1 = off2 = 0;
+  while(off1 < 100*512 || off2 < 100*512){
+    n = read(fd1, buf, 700);
+    for(i = 0; i < n; i++)
+      if(buf[i] != (char)((off1 + i) / 512)){
+        printf(stdout, "readahead test: wrong data at %d\n", off1 + i);
+        exit();
+      }
+    off1 += n;
+    n = read(fd2, buf, 300);
+    for(i = 0; i < n; i++)
+      if(buf[i] != (char)((off2 + i) / 512)){
+        printf(stdout, "readahead test: wrong data at %d\n", off2 + i);
+        exit();
+      }
+    off2 += n;
+  }
+  close(fd1);
+  close(fd2);
+  unlink("ra");
+  printf(stdout, "readahead test ok\n");
+}
+
+// Commits happen in the background; fsync() waits for them.
+void
+fsynctest(void)
+{
+  int fd, fds[2];
+
+  printf(stdout, "fsync test\n");
+  unlink("fsyncf");
+  if((fd = open("fsyncf", O_CREATE|O_RDWR)) < 0){
+    printf(stdout, "fsync test: create failed\n");
+    exit();
+  }
+  memset(buf, 'f', 512);
+  if(write(fd, buf, 512) != 512 || fsync(fd) != 0){
+    printf(stdout, "fsync test: fsync failed\n");
+    exit();
+  }
+  // Nothing left to commit.
+  if(fsync(fd) != 0){
+    printf(stdout, "fsync test: second fsync failed\n");
+    exit();
+  }
+  close(fd);
+  if(fsync(fd) != -1){
+    printf(stdout, "fsync test: fsync of closed fd succeeded\n");
+    exit();
+  }
+  if(pipe(fds) != 0 || fsync(fds[0]) != -1){
+    printf(stdout, "fsync test: fsync of a pipe succeeded\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+  unlink("fsyncf");
+  printf(stdout, "fsync test ok\n");
+}
+
+// Appends of whole blocks write their data in place instead of
+// through the log; check that it reads back, also after a write
+// that does not fill its block sends appends back to writei.
+void
+bulkwritetest(void)
+{
+  char *p;
+  int fd, i, n;
+
+  printf(stdout, "bulk write test\n");
+  n = (NBULK + NBULK/2) * BSIZE;
+  if((p = malloc(n)) == 0){
+    printf(stdout, "bulk write test: malloc failed\n");
+    exit();
+  }
+  for(i = 0; i < n; i++)
+    p[i] = i / BSIZE + i;
+  unlink("bulkf");
+  if((fd = open("bulkf", O_CREATE|O_RDWR)) < 0){
+    printf(stdout, "bulk write test: create failed\n");
+    exit();
+  }
+  if(write(fd, p, n - BSIZE) != n - BSIZE ||
+     write(fd, p + n - BSIZE, 100) != 100 ||
+     write(fd, p + n - BSIZE + 100, BSIZE - 100) != BSIZE - 100){
+    printf(stdout, "bulk write test: write failed\n");
+    exit();
+  }
+  close(fd);
+
+  memset(p, 0, n);
+  if((fd = open("bulkf", O_RDONLY)) < 0 || read(fd, p, n) != n){
+    printf(stdout, "bulk write test: read failed\n");
+    exit();
+  }
+  for(i = 0; i < n; i++){
+    if(p[i] != (char)(i / BSIZE + i)){
+      printf(stdout, "bulk write test: wrong data at %d\n", i);
+      exit();
+    }
+  }
+  close(fd);
+  free(p);
+  unlink("bulkf");
+  printf(stdout, "bulk write test ok\n");
+}
+
+// Blocks in the huge file: into the triple-indirect ones.
+#define NHUGE (NDIRECT + NINDIRECT + NINDIRECT*NINDIRECT + NINDIRECT)
+#define HUGECHUNK (128*BSIZE)
+
+// Write and read back a file of several MB, which takes every
+// level of indirect blocks, and report how long each took.
+void
+hugefiletest(void)
+{
+  char *p;
+  int fd, i, j, n, t0, twrite, tread;
+
+  printf(stdout, "huge file test\n");
+  if((p = malloc(HUGECHUNK)) == 0){
+    printf(stdout, "huge file test: malloc failed\n");
+    exit();
+  }
+  unlink("hugef");
+  if((fd = open("hugef", O_CREATE|O_RDWR)) < 0){
+    printf(stdout, "huge file test: create failed\n");
+    exit();
+  }
+  t0 = uptime();
+  for(i = 0; i < NHUGE; i += n){
+    n = NHUGE - i < HUGECHUNK/BSIZE ? NHUGE - i : HUGECHUNK/BSIZE;
+    for(j = 0; j < n; j++){
+      memset(p + j*BSIZE, 'a' + (i + j) % 26, BSIZE);
+      ((int*)(p + j*BSIZE))[0] = i + j;
+    }
+    if(write(fd, p, n*BSIZE) != n*BSIZE){
+      printf(stdout, "huge file test: write failed at block %d\n", i);
+      exit();
+    }
+  }
+  fsync(fd);
+  twrite = uptime() - t0;
+  close(fd);
+
+  if((fd = open("hugef", O_RDONLY)) < 0){
+    printf(stdout, "huge file test: open failed\n");
+    exit();
+  }
+  t0 = uptime();
+  for(i = 0; (n = read(fd, p, HUGECHUNK)) > 0; i += n/BSIZE){
+    for(j = 0; j < n/BSIZE; j++){
+      if(((int*)(p + j*BSIZE))[0] != i + j ||
+         p[j*BSIZE + BSIZE - 1] != 'a' + (i + j) % 26){
+        printf(stdout, "huge file test: block %d is wrong\n", i + j);
+        exit();
+      }
+    }
+  }
+  tread = uptime() - t0;
+  close(fd);
+  if(i != NHUGE){
+    printf(stdout, "huge file test: read %d blocks of %d\n", i, NHUGE);
+    exit();
+  }
+  if(unlink("hugef") < 0){
+    printf(stdout, "huge file test: unlink failed\n");
+    exit();
+  }
+  free(p);
+  printf(stdout, "huge file test ok: %d KB, write %d ticks, read %d ticks\n",
+         NHUGE*BSIZE/1024, twrite, tread);
+}
+
+// More files than an extent file system has places to start
+// them, so that at least two share one.  They are more than one
+// process may have open, so two processes take turns.
+#define NAPPEND (NEXTGROUP + 1)
+#define NAPBLK  100
+
+// Append block j to each of files first .. first+n-1.
+static void
+appendblocks(int *fd, int first, int n, int j)
+{
+  int i;
+
+  for(i = first; i < first + n; i++){
+    memset(buf, 'a' + (i + j) % 26, BSIZE);
+    ((int*)buf)[0] = i;
+    ((int*)buf)[1] = j;
+    if(write(fd[i], buf, BSIZE) != BSIZE){
+      printf(stdout, "append test: write %d of file %d failed\n", j, i);
+      exit();
+    }
+  }
+}
+
+// Append a block at a time to each of NAPPEND files in turn, as
+// concurrent writers would.  On an extent file system (mkfs -e)
+// files that start in the same place get their blocks in turns,
+// a new extent for each, which takes more extent blocks than the
+// first; every file must still come out whole.
+void
+appendtest(void)
+{
+  char name[3], c;
+  int fd[NAPPEND], p1[2], p2[2], i, j, k, half, pid;
+
+  printf(stdout, "append test\n");
+  half = NAPPEND / 2;
+  name[0] = 'a';
+  name[2] = 0;
+  for(i = 0; i < NAPPEND; i++){
+    name[1] = 'a' + i;
+    unlink(name);
+  }
+  if(pipe(p1) < 0 || pipe(p2) < 0){
+    printf(stdout, "append test: pipe failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "append test: fork failed\n");
+    exit();
+  }
+
+  // The parent appends to the first half of the files and the
+  // child to the rest, handing a byte back and forth each round.
+  if(pid){
+    close(p1[0]);
+    close(p2[1]);
+  } else {
+    close(p1[1]);
+    close(p2[0]);
+  }
+  for(i = pid ? 0 : half; i < (pid ? half : NAPPEND); i++){
+    name[1] = 'a' + i;
+    if((fd[i] = open(name, O_CREATE|O_RDWR)) < 0){
+      printf(stdout, "append test: create %s failed\n", name);
+      exit();
+    }
+  }
+  for(j = 0; j < NAPBLK; j++){
+    if(pid){
+      appendblocks(fd, 0, half, j);
+      write(p1[1], "x", 1);
+      if(read(p2[0], &c, 1) != 1){
+        printf(stdout, "append test: child failed\n");
+        exit();
+      }
+    } else {
+      if(read(p1[0], &c, 1) != 1)
+        exit();
+      appendblocks(fd, half, NAPPEND - half, j);
+      write(p2[1], "x", 1);
+    }
+  }
+  for(i = pid ? 0 : half; i < (pid ? half : NAPPEND); i++)
+    close(fd[i]);
+  if(pid == 0)
+    exit();
+  wait();
+  close(p1[1]);
+  close(p2[0]);
+
+  for(i = 0; i < NAPPEND; i++){
+    name[1] = 'a' + i;
+    if((fd[i] = open(name, O_RDONLY)) < 0){
+      printf(stdout, "append test: open %s failed\n", name);
+      exit();
+    }
+    for(j = 0; j < NAPBLK; j++){
+      if(read(fd[i], buf, BSIZE) != BSIZE){
+        printf(stdout, "append test: %s is short\n", name);
+        exit();
+      }
+      for(k = 8; k < BSIZE; k++)
+        if(buf[k] != 'a' + (i + j) % 26)
+          break;
+      if(((int*)buf)[0] != i || ((int*)buf)[1] != j || k < BSIZE){
+        printf(stdout, "append test: %s block %d is wrong\n", name, j);
+        exit();
+      }
+    }
+    close(fd[i]);
+    unlink(name);
+  }
+  printf(stdout, "append test ok\n");
+}
+
+// Several processes write and reread files of their own at the
+// same time, so that lookups and recycling of buffers in the
+// block cache interleave.
+#define NCHILD 4
+#define NBLK   40
+
+void
+bcachetest(void)
+{
+  char name[8];
+  int c, i, j, pid, fd;
+
+  printf(stdout, "bcache test\n");
+  for(c = 0; c < NCHILD; c++){
+    pid = fork();
+    if(pid < 0){
+      printf(stdout, "bcache test: fork failed\n");
+      exit();
+    }
+    if(pid > 0)
+      continue;
+    strcpy(name, "bc0");
+    name[2] = '0' + c;
+    unlink(name);
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+      printf(stdout, "bcache test: create %s failed\n", name);
+      exit();
+    }
+    for(i = 0; i < NBLK; i++){
+      memset(buf, c*NBLK + i, 512);
+      if(write(fd, buf, 512) != 512){
+        printf(stdout, "bcache test: write %s failed\n", name);
+        exit();
+      }
+    }
+    close(fd);
+    for(j = 0; j < 5; j++){
+      if((fd = open(name, O_RDONLY)) < 0){
+        printf(stdout, "bcache test: open %s failed\n", name);
+        exit();
+      }
+      for(i = 0; i < NBLK; i++){
+        if(read(fd, buf, 512) != 512 || buf[0] != (char)(c*NBLK + i) ||
+           buf[511] != (char)(c*NBLK + i)){
+          printf(stdout, "bcache test: %s block %d wrong\n", name, i);
+          exit();
+        }
+      }
+      close(fd);
+    }
+    unlink(name);
+    exit();
+  }
+  for(c = 0; c < NCHILD; c++)
+    wait();
+  printf(stdout, "bcache test ok\n");
+}
+#undef NCHILD
+#undef NBLK
+
+// One child fills nearly all free memory and goes to sleep; a
+// second one then needs more, so pages of the first must be paged
+// out, and come back intact when it wakes.
+void
+swaptest(void)
+{
+  struct swapstat st0, st;
+  int ready[2], go[2], pid, n1, n2;
+  char *a, c;
+
+  printf(stdout, "swap test\n");
+  if(swapstat(&st0) < 0){
+    printf(stdout, "swap test: swapstat failed\n");
+    exit();
+  }
+  if(st0.total < 2048){
+    printf(stdout, "swap test: no swap space, skipped\n");
+    return;
+  }
+  n1 = st0.freemem - 512;
+  n2 = 2048;
+  if(pipe(ready) < 0 || pipe(go) < 0){
+    printf(stdout, "swap test: pipe failed\n");
+    exit();
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "swap test: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if((a = swapfill(n1)) == 0){
+      write(ready[1], "n", 1);
+      exit();
+    }
+    write(ready[1], "y", 1);
+    read(go[0], &c, 1);
+    write(ready[1], swapcheck(a, n1) == 0 ? "y" : "n", 1);
+    exit();
+  }
+  if(read(ready[0], &c, 1) != 1 || c != 'y'){
+    printf(stdout, "swap test: first child could not fill memory\n");
+    exit();
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "swap test: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if((a = swapfill(n2)) == 0 || swapcheck(a, n2) < 0){
+      printf(stdout, "swap test: second child lost memory\n");
+      exit();
+    }
+    exit();
+  }
+  wait();
+
+  write(go[1], "x", 1);
+  if(read(ready[0], &c, 1) != 1 || c != 'y'){
+    printf(stdout, "swap test: pages did not come back from swap\n");
+    exit();
+  }
+  wait();
+  close(ready[0]);
+  close(ready[1]);
+  close(go[0]);
+  close(go[1]);
+
+  if(swapstat(&st) < 0 || st.nout <= st0.nout || st.nin <= st0.nin){
+    printf(stdout, "swap test: nothing was paged out and in\n");
+    exit();
+  }
+  printf(stdout, "swap test ok\n");
+}
+
 void
 validateint(int *p)
 {
@@ -1643,7 +2623,7 @@ bigargtest(void)
 }
 
 // what happens when the file system runs out of blocks?
-// answer: balloc panics, so this test is not useful.
+// answer: writes come up short (see fillfs for a test that checks).
 void
 fsfull()
 {
@@ -1745,6 +2725,50 @@ rand()
   return randstate;
 }
 
+// allocation benchmark: rounds of small blocks of mixed sizes
+// freed in an interleaved order, then big blocks.  Checks that
+// blocks do not overlap and reports the time taken.
+#define NMBLK 1000
+void
+mallocbench(void)
+{
+  static char *p[NMBLK];
+  static int sz[NMBLK];
+  int i, j, k, start;
+
+  printf(stdout, "malloc bench\n");
+  start = uptime();
+  for(i = 0; i < 100; i++){
+    for(j = 0; j < NMBLK; j++){
+      sz[j] = rand() % 600 + 1;
+      if((p[j] = malloc(sz[j])) == 0){
+        printf(stdout, "malloc bench: malloc failed\n");
+        exit();
+      }
+      memset(p[j], j, sz[j]);
+    }
+    for(k = 0; k < 2; k++){
+      for(j = k; j < NMBLK; j += 2){
+        if(p[j][0] != (char)j || p[j][sz[j]-1] != (char)j){
+          printf(stdout, "malloc bench: blocks overlap\n");
+          exit();
+        }
+        free(p[j]);
+      }
+    }
+  }
+  for(i = 0; i < 100; i++){
+    j = rand() % (512*1024) + 70*1024;
+    if((p[0] = malloc(j)) == 0){
+      printf(stdout, "malloc bench: big malloc failed\n");
+      exit();
+    }
+    p[0][0] = p[0][j-1] = 1;
+    free(p[0]);
+  }
+  printf(stdout, "malloc bench ok: %d ticks\n", uptime() - start);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -1768,6 +2792,20 @@ main(int argc, char *argv[])
   bigargtest();
   bsstest();
   sbrktest();
+  lazysbrktest();
+  bigpagetest();
+  texttest();
+  mmaptest();
+  shmtest();
+  swaptest();
+  threadtest();
+  bcachetest();
+  readaheadtest();
+  fsynctest();
+  bulkwritetest();
+  hugefiletest();
+  appendtest();
+  fputest();
   validatetest();
 
   opentest();
@@ -1780,6 +2818,7 @@ main(int argc, char *argv[])
   iputtest();
 
   mem();
+  mallocbench();
   pipe1();
   preempt();
   exitwait();
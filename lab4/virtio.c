@@ -0,0 +1,269 @@
+// Driver for a virtio block device (legacy PCI interface), as
+// QEMU provides with -device virtio-blk-pci.  When there is one, it
+// serves the file system disk (ROOTDEV) in place of IDE disk 1.
+//
+// Requests go to the device through a ring of descriptors that
+// it reads from memory, so unlike the IDE disk it can have many of
+// them in flight; each takes three descriptors, for the request
+// header, the data and the status byte.  The device puts finished
+// requests on the used ring and interrupts.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "traps.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "pci.h"
+
+#define SECTOR_SIZE 512
+
+// Legacy virtio registers, from the I/O base in BAR0.
+#define VIO_HOSTFEAT   0x00
+#define VIO_GUESTFEAT  0x04
+#define VIO_QPFN       0x08  // physical page number of the queue
+#define VIO_QSIZE      0x0C
+#define VIO_QSEL       0x0E
+#define VIO_QNOTIFY    0x10
+#define VIO_STATUS     0x12
+  #define VIO_ACK        0x01
+  #define VIO_DRIVER     0x02
+  #define VIO_DRIVER_OK  0x04
+  #define VIO_FAILED     0x80
+#define VIO_ISR        0x13  // reading acknowledges the interrupt
+#define VIO_CAPACITY   0x14  // device config: size in sectors
+
+#define VRING_NEXT     1     // descriptor flags
+#define VRING_WRITE    2     // device writes the buffer
+
+#define VBLK_IN        0     // request types
+#define VBLK_OUT       1
+
+#define NDESC          256   // most descriptors the queue memory fits
+
+struct vdesc {
+  uint addr, addrhi;
+  uint len;
+  ushort flags;
+  ushort next;
+};
+
+struct vavail {
+  ushort flags;
+  ushort idx;
+  ushort ring[];
+};
+
+struct vused {
+  ushort flags;
+  ushort idx;
+  struct {
+    uint id;
+    uint len;
+  } ring[];
+};
+
+// A request, kept at the index of its first descriptor.
+struct vreq {
+  struct {
+    uint type;
+    uint reserved;
+    uint sector, sectorhi;
+  } hdr;
+  uchar status;
+  struct buf *b;
+};
+
+static char vqmem[3*PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static struct {
+  struct spinlock lock;
+  uint base;             // I/O base
+  uint qsize;            // descriptors in the queue
+  uint nsect;            // capacity
+  struct vdesc *desc;
+  struct vavail *avail;
+  struct vused *used;
+  ushort usedidx;        // next entry of used to look at
+  uchar free[NDESC];     // descriptor is free
+  int nfree;
+  struct vreq req[NDESC];
+} vio;
+
+int virtioirq;
+
+static void virtiorw(struct buf*);
+
+void
+virtioinit(void)
+{
+  struct pcidev *d;
+  uint i, usedoff;
+
+  if((d = pcifind(0x1AF4, 0x1001, 0, 0)) == 0 || !d->baseio[0])
+    return;
+  initlock(&vio.lock, "virtio");
+  pcienable(d);
+  vio.base = d->bar[0];
+
+  outb(vio.base + VIO_STATUS, 0);  // reset
+  outb(vio.base + VIO_STATUS, VIO_ACK);
+  outb(vio.base + VIO_STATUS, VIO_ACK|VIO_DRIVER);
+  outl(vio.base + VIO_GUESTFEAT, 0);  // no optional features
+
+  // The queue: descriptors, then the available ring, then the
+  // used ring on the next page boundary.
+  outw(vio.base + VIO_QSEL, 0);
+  vio.qsize = inw(vio.base + VIO_QSIZE);
+  usedoff = PGROUNDUP(vio.qsize*sizeof(struct vdesc) + 6 + 2*vio.qsize);
+  if(vio.qsize == 0 || vio.qsize > NDESC ||
+     usedoff + 6 + 8*vio.qsize > sizeof(vqmem)){
+    outb(vio.base + VIO_STATUS, VIO_FAILED);
+    return;
+  }
+  memset(vqmem, 0, sizeof(vqmem));
+  vio.desc = (struct vdesc*)vqmem;
+  vio.avail = (struct vavail*)(vqmem + vio.qsize*sizeof(struct vdesc));
+  vio.used = (struct vused*)(vqmem + usedoff);
+  for(i = 0; i < vio.qsize; i++)
+    vio.free[i] = 1;
+  vio.nfree = vio.qsize;
+  outl(vio.base + VIO_QPFN, V2P(vqmem) / PGSIZE);
+
+  vio.nsect = inl(vio.base + VIO_CAPACITY);
+  if(inl(vio.base + VIO_CAPACITY + 4))
+    vio.nsect = 0xFFFFFFFF;  // sector numbers are 32 bits here
+  virtioirq = d->irq;
+  ioapicenable(virtioirq, ncpu - 1);
+  outb(vio.base + VIO_STATUS, VIO_ACK|VIO_DRIVER|VIO_DRIVER_OK);
+
+  bdevsw[ROOTDEV].rw = virtiorw;
+  cprintf("virtio: disk %d sectors, queue %d, irq %d\n",
+          vio.nsect, vio.qsize, virtioirq);
+}
+
+// Take a free descriptor.  Caller must hold vio.lock and
+// know that there is one.
+static int
+allocdesc(void)
+{
+  int i;
+
+  for(i = 0; i < vio.qsize; i++){
+    if(vio.free[i]){
+      vio.free[i] = 0;
+      vio.nfree--;
+      return i;
+    }
+  }
+  panic("virtio: no descriptors");
+}
+
+static void
+freedesc(int i)
+{
+  vio.free[i] = 1;
+  vio.nfree++;
+}
+
+// Sync buf with disk, like iderw.
+static void
+virtiorw(struct buf *b)
+{
+  struct vreq *r;
+  int d[3], write;
+
+  if(!holdingsleep(&b->lock))
+    panic("virtiorw: buf not locked");
+  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
+    panic("virtiorw: nothing to do");
+  if((b->blockno + 1) * (BSIZE/SECTOR_SIZE) > vio.nsect)
+    panic("virtiorw: block out of range");
+  write = b->flags & B_DIRTY;
+
+  acquire(&vio.lock);
+  while(vio.nfree < 3)
+    sleep(&vio.free, &vio.lock);
+  d[0] = allocdesc();
+  d[1] = allocdesc();
+  d[2] = allocdesc();
+
+  r = &vio.req[d[0]];
+  r->hdr.type = write ? VBLK_OUT : VBLK_IN;
+  r->hdr.reserved = 0;
+  r->hdr.sector = b->blockno * (BSIZE/SECTOR_SIZE);
+  r->hdr.sectorhi = 0;
+  r->status = 0xFF;
+  r->b = b;
+
+  vio.desc[d[0]].addr = V2P(&r->hdr);
+  vio.desc[d[0]].len = sizeof(r->hdr);
+  vio.desc[d[0]].flags = VRING_NEXT;
+  vio.desc[d[0]].next = d[1];
+  vio.desc[d[1]].addr = V2P(b->data);
+  vio.desc[d[1]].len = BSIZE;
+  vio.desc[d[1]].flags = VRING_NEXT | (write ? 0 : VRING_WRITE);
+  vio.desc[d[1]].next = d[2];
+  vio.desc[d[2]].addr = V2P(&r->status);
+  vio.desc[d[2]].len = 1;
+  vio.desc[d[2]].flags = VRING_WRITE;
+  vio.desc[d[2]].next = 0;
+
+  // The device must see the descriptors before the ring entry,
+  // and the entry before the new index.
+  vio.avail->ring[vio.avail->idx % vio.qsize] = d[0];
+  __sync_synchronize();
+  vio.avail->idx++;
+  __sync_synchronize();
+  outw(vio.base + VIO_QNOTIFY, 0);
+
+  if(b->flags & B_ASYNC){
+    release(&vio.lock);
+    return;
+  }
+
+  // Wait for request to finish.
+  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID)
+    sleep(b, &vio.lock);
+  release(&vio.lock);
+}
+
+// Interrupt handler.
+void
+virtiointr(void)
+{
+  struct vreq *r;
+  struct buf *b;
+  uint id;
+
+  acquire(&vio.lock);
+  // Acknowledge first: requests that finish from here on
+  // interrupt again.
+  inb(vio.base + VIO_ISR);
+  while(vio.usedidx != *(volatile ushort*)&vio.used->idx){
+    __sync_synchronize();
+    id = vio.used->ring[vio.usedidx % vio.qsize].id;
+    vio.usedidx++;
+    r = &vio.req[id];
+    b = r->b;
+    // Like ide.c, a failed request (r->status != 0) is not retried.
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->flags & B_ASYNC){
+      b->flags &= ~B_ASYNC;
+      bdone(b);
+    } else
+      wakeup(b);
+    freedesc(vio.desc[vio.desc[id].next].next);
+    freedesc(vio.desc[id].next);
+    freedesc(id);
+  }
+  wakeup(&vio.free);
+  release(&vio.lock);
+}
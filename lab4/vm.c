@@ -5,11 +5,20 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
 #include "elf.h"
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
 
+// Threads sharing a page table can fault on the same page at
+// once; uvmlock makes uvmmap's check and update atomic.  growproc
+// also holds it while it changes p->sz, so that uvmmap cannot map
+// a page that a sibling's sbrk has just dropped from the heap.
+struct spinlock uvmlock;
+
+
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
 void
@@ -31,21 +40,23 @@ seginit(void)
 
 // Return the address of the PTE in page table pgdir
 // that corresponds to virtual address va.  If alloc!=0,
-// create any required page table pages.
-static pte_t *
+// create any required page table pages.  If va lies in a
+// 4MB superpage, return the page directory entry (with PTE_PS).
+pte_t *
 walkpgdir(pde_t *pgdir, const void *va, int alloc)
 {
   pde_t *pde;
   pte_t *pgtab;
 
   pde = &pgdir[PDX(va)];
+  if(*pde & PTE_PS)
+    return pde;
   if(*pde & PTE_P){
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
   } else {
-    if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
-      return 0;
     // Make sure all those PTE_P bits are zero.
-    memset(pgtab, 0, PGSIZE);
+    if(!alloc || (pgtab = (pte_t*)kalloc_zeroed()) == 0)
+      return 0;
     // The permissions here are overly generous, but they can
     // be further restricted by the permissions in the page table
     // entries, if necessary.
@@ -57,7 +68,7 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned.
-static int
+int
 mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 {
   char *a, *last;
@@ -79,6 +90,39 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
   return 0;
 }
 
+// Like mappages, but use 4MB superpages for the parts of
+// [va, va+size) that are 4MB-aligned.  Only for the kernel's
+// mappings, which walkpgdir is never asked about.  They are
+// the same in every page table, so they are made global and
+// the lcr3 in switchuvm does not flush them from the TLB (unless
+// built with NOPGE, for measuring what that saves).
+// va, pa and size must be page-aligned.
+static int
+mapkvm(pde_t *pgdir, char *va, uint size, uint pa, int perm)
+{
+  uint n;
+
+#ifndef NOPGE
+  perm |= PTE_G;
+#endif
+  while(size > 0){
+    if((uint)va % SPGSIZE == 0 && pa % SPGSIZE == 0 && size >= SPGSIZE){
+      pgdir[PDX(va)] = pa | perm | PTE_P | PTE_PS;
+      n = SPGSIZE;
+    } else {
+      n = SPGSIZE - (uint)va % SPGSIZE;
+      if(n > size)
+        n = size;
+      if(mappages(pgdir, va, n, pa, perm) < 0)
+        return -1;
+    }
+    va += n;
+    pa += n;
+    size -= n;
+  }
+  return 0;
+}
+
 // There is one page table per process, plus one that's used when
 // a CPU is not running any process (kpgdir). The kernel uses the
 // current process's page table during system calls and interrupts;
@@ -92,13 +136,16 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 //   KERNBASE..KERNBASE+EXTMEM: mapped to 0..EXTMEM (for I/O space)
 //   KERNBASE+EXTMEM..data: mapped to EXTMEM..V2P(data)
 //                for the kernel's instructions and r/o data
-//   data..KERNBASE+PHYSTOP: mapped to V2P(data)..PHYSTOP,
+//   data..KERNBASE+phystop: mapped to V2P(data)..phystop,
 //                                  rw data + free physical memory
 //   0xfe000000..0: mapped direct (devices such as ioapic)
 //
 // The kernel allocates physical memory for its heap and for user memory
-// between V2P(end) and the end of physical memory (PHYSTOP)
-// (directly addressable from end..P2V(PHYSTOP)).
+// between V2P(end) and the end of physical memory (phystop, found
+// at boot by kinit1) (directly addressable from end..P2V(phystop)).
+// The direct map uses 4MB pages where it can.  The kernel half is
+// the same in every page table, so all page tables share kpgdir's
+// entries for it.
 
 // This table defines the kernel's mappings, which are present in
 // every process's page table.
@@ -110,7 +157,7 @@ static struct kmap {
 } kmap[] = {
  { (void*)KERNBASE, 0,             EXTMEM,    PTE_W}, // I/O space
  { (void*)KERNLINK, V2P(KERNLINK), V2P(data), 0},     // kern text+rodata
- { (void*)data,     V2P(data),     PHYSTOP,   PTE_W}, // kern data+memory
+ { (void*)data,     V2P(data),     0,         PTE_W}, // kern data+memory
  { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W}, // more devices
 };
 
@@ -121,14 +168,16 @@ setupkvm(void)
   pde_t *pgdir;
   struct kmap *k;
 
-  if((pgdir = (pde_t*)kalloc()) == 0)
+  if((pgdir = (pde_t*)kalloc_zeroed()) == 0)
     return 0;
-  memset(pgdir, 0, PGSIZE);
-  if (P2V(PHYSTOP) > (void*)DEVSPACE)
-    panic("PHYSTOP too high");
+  if(kpgdir){
+    memmove(&pgdir[PDX(KERNBASE)], &kpgdir[PDX(KERNBASE)],
+            (NPDENTRIES - PDX(KERNBASE)) * sizeof(pde_t));
+    return pgdir;
+  }
   for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
-    if(mappages(pgdir, k->virt, k->phys_end - k->phys_start,
-                (uint)k->phys_start, k->perm) < 0) {
+    if(mapkvm(pgdir, k->virt, k->phys_end - k->phys_start,
+              (uint)k->phys_start, k->perm) < 0) {
       freevm(pgdir);
       return 0;
     }
@@ -140,8 +189,93 @@ setupkvm(void)
 void
 kvmalloc(void)
 {
-  kpgdir = setupkvm();
+  kmap[2].phys_end = phystop;
+  if((kpgdir = setupkvm()) == 0)
+    panic("kvmalloc");
   switchkvm();
+  initlock(&uvmlock, "uvm");
+}
+
+// The CPUs whose TLBs may hold user translations of pgdir: those
+// that have it loaded.  A CPU that stops running a process loads
+// kpgdir, which flushes them.
+static uint
+pgdircpus(pde_t *pgdir)
+{
+  uint mask;
+  int i;
+
+  mask = 0;
+  for(i = 0; i < ncpu; i++)
+    if(cpus[i].pgdir == pgdir)
+      mask |= 1 << i;
+  return mask;
+}
+
+static void
+tlbflushipi(void *pgdir)
+{
+  if(mycpu()->pgdir == pgdir)
+    lcr3(rcr3());
+}
+
+// Flush stale user translations of pgdir from the TLBs, after
+// entries of it were removed.  Reloading %cr3 flushes this CPU;
+// the other CPUs running threads of pgdir are asked to do the same
+// (see ipicall), and the caller waits until they have.  The caller
+// must be running on pgdir and must not hold a spinlock.
+void
+tlbflush(pde_t *pgdir)
+{
+  uint mask;
+
+  pushcli();
+  lcr3(V2P(pgdir));
+  // The PTE stores must be visible before we look at which CPUs
+  // have pgdir loaded: a CPU that loads it later sees them.
+  __sync_synchronize();
+  mask = pgdircpus(pgdir) & ~(1 << cpuid());
+  popcli();
+  ipicall(mask, tlbflushipi, pgdir);
+}
+
+// Pages unmapped from a page table that other CPUs may still
+// have in their TLBs are collected in a tlbbatch and freed after
+// one shootdown for the lot.
+void
+tlbbatchinit(struct tlbbatch *b, pde_t *pgdir)
+{
+  b->pgdir = pgdir;
+  b->n = 0;
+}
+
+// Flush the TLBs and free the collected pages.
+void
+tlbbatchflush(struct tlbbatch *b)
+{
+  int i;
+
+  if(b->n == 0)
+    return;
+  tlbflush(b->pgdir);
+  for(i = 0; i < b->n; i++){
+    if(b->big[i])
+      kfreebig(b->pages[i]);
+    else
+      kfree(b->pages[i]);
+  }
+  b->n = 0;
+}
+
+// Free page (a superpage if big) once no TLB can reach it.
+void
+tlbbatchadd(struct tlbbatch *b, char *page, int big)
+{
+  if(b->n == NELEM(b->pages))
+    tlbbatchflush(b);
+  b->pages[b->n] = page;
+  b->big[b->n] = big;
+  b->n++;
 }
 
 // Switch h/w page table register to the kernel-only page table,
@@ -173,6 +307,7 @@ switchuvm(struct proc *p)
   // forbids I/O instructions (e.g., inb and outb) from user space
   mycpu()->ts.iomb = (ushort) 0xFFFF;
   ltr(SEG_TSS << 3);
+  mycpu()->pgdir = p->pgdir;
   lcr3(V2P(p->pgdir));  // switch to process's address space
   popcli();
 }
@@ -186,8 +321,7 @@ inituvm(pde_t *pgdir, char *init, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pgdir, 0, PGSIZE, V2P(mem), PTE_W|PTE_U);
   memmove(mem, init, sz);
 }
@@ -231,13 +365,12 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 
   a = PGROUNDUP(oldsz);
   for(; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       cprintf("allocuvm out of memory\n");
       deallocuvm(pgdir, newsz, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
       cprintf("allocuvm out of memory (2)\n");
       deallocuvm(pgdir, newsz, oldsz);
@@ -248,38 +381,97 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
   return newsz;
 }
 
+// Replace the superpage mapped by *pde with a page table that
+// maps the same pages.  From then on they are freed one by one.
+// Returns 0 on success, -1 if there is no memory for the table.
+static int
+splitbig(pde_t *pde)
+{
+  pte_t *pgtab;
+  uint pa, flags, i;
+
+  if((pgtab = (pte_t*)kalloc()) == 0)
+    return -1;
+  pa = PTE_ADDR(*pde);
+  flags = PTE_FLAGS(*pde) & ~PTE_PS;
+  for(i = 0; i < NPTENTRIES; i++)
+    pgtab[i] = (pa + i*PGSIZE) | flags;
+  *pde = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
+  return 0;
+}
+
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  A superpage that is only partly freed and cannot
+// be split stays mapped, with the part above newsz zeroed.
+// Returns newsz.  If threads share
+// pgdir, the caller must be running on it and hold no spinlock:
+// the pages are freed in batches, each after a TLB shootdown.
 int
 deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 {
   pte_t *pte;
-  uint a, pa;
+  uint a, pa, end;
+  int shared;
+  struct tlbbatch b;
 
   if(newsz >= oldsz)
     return oldsz;
+  shared = krefcount((char*)pgdir) > 1;
+  tlbbatchinit(&b, pgdir);
 
   a = PGROUNDUP(newsz);
   for(; a  < oldsz; a += PGSIZE){
     pte = walkpgdir(pgdir, (char*)a, 0);
+    if(pte && (*pte & PTE_PS)){
+      if(a % SPGSIZE == 0 && a + SPGSIZE <= oldsz){
+        pa = PTE_ADDR(*pte);
+        *pte = 0;
+        if(shared)
+          tlbbatchadd(&b, P2V(pa), 1);
+        else
+          kfreebig(P2V(pa));
+        a += SPGSIZE - PGSIZE;
+        continue;
+      }
+      // Only the pages from a up go away.  Without memory for
+      // a page table, keep the superpage but zero them, so that
+      // growing again finds zeroed memory, and go on past it.
+      if(splitbig(pte) < 0){
+        pa = PTE_ADDR(*pte) + a % SPGSIZE;
+        end = a - a % SPGSIZE + SPGSIZE;
+        if(end > oldsz)
+          end = PGROUNDUP(oldsz);
+        memset(P2V(pa), 0, end - a);
+        a = end - PGSIZE;
+        continue;
+      }
+      pte = walkpgdir(pgdir, (char*)a, 0);
+    }
     if(!pte)
       a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
     else if((*pte & PTE_P) != 0){
       pa = PTE_ADDR(*pte);
       if(pa == 0)
         panic("kfree");
+      *pte = 0;
       char *v = P2V(pa);
-      kfree(v);
+      if(shared)
+        tlbbatchadd(&b, v, 0);
+      else
+        kfree(v);
+    } else if(*pte & PTE_SWAP){
+      swapfree(PTE_SLOT(*pte));
       *pte = 0;
     }
   }
+  tlbbatchflush(&b);
   return newsz;
 }
 
 // Free a page table and all the physical memory pages
-// in the user part.
+// in the user part.  The kernel part belongs to kpgdir.
 void
 freevm(pde_t *pgdir)
 {
@@ -288,7 +480,7 @@ freevm(pde_t *pgdir)
   if(pgdir == 0)
     panic("freevm: no pgdir");
   deallocuvm(pgdir, KERNBASE, 0);
-  for(i = 0; i < NPDENTRIES; i++){
+  for(i = 0; i < PDX(KERNBASE); i++){
     if(pgdir[i] & PTE_P){
       char * v = P2V(PTE_ADDR(pgdir[i]));
       kfree(v);
@@ -316,20 +508,55 @@ pde_t*
 copyuvm(pde_t *pgdir, uint sz)
 {
   pde_t *d;
-  pte_t *pte;
+  pte_t *pte, *npte;
   uint pa, i, flags;
   char *mem;
 
   if((d = setupkvm()) == 0)
     return 0;
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
-    if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
+    // Heap pages that were never touched are not backed yet;
+    // the child will fault them in on its own.
+    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0){
+      i = PGADDR(PDX(i) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
+    if(!(*pte & PTE_P)){
+      if(*pte & PTE_SWAP){
+        // Paged out: the child shares the swap slot.
+        if((npte = walkpgdir(d, (void*)i, 1)) == 0)
+          goto bad;
+        swapdup(PTE_SLOT(*pte));
+        *npte = *pte;
+      }
+      continue;
+    }
     pa = PTE_ADDR(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(flags & PTE_PS){
+      // Copy a superpage into a superpage if there is a free
+      // chunk, else into ordinary pages.
+      if(i % SPGSIZE == 0 && (mem = kallocbig()) != 0){
+        memmove(mem, (char*)P2V(pa), SPGSIZE);
+        d[PDX(i)] = V2P(mem) | flags;
+        i += SPGSIZE - PGSIZE;
+        continue;
+      }
+      pa += i % SPGSIZE;
+      flags &= ~PTE_PS;
+    }
+    if(!(flags & PTE_W)){
+      // Read-only pages (shared text) are shared, not copied.
+      kref(P2V(pa));
+      if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0){
+        kfree(P2V(pa));
+        goto bad;
+      }
+      continue;
+    }
+    // swapalloc may sleep; pa stays valid only because fork()
+    // has pinned the parent's pages.
+    if((mem = swapalloc()) == 0)
       goto bad;
     memmove(mem, (char*)P2V(pa), PGSIZE);
     if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
@@ -344,6 +571,274 @@ bad:
   return 0;
 }
 
+// Return the segment from which the page at va can be mapped
+// straight out of the page cache: a read-only segment laid out so
+// that the page lines up with a page of the file, with no bss and
+// no other segment sharing the page.  Returns 0 if the page needs
+// a private copy.
+static struct pseg*
+sharedseg(struct pseg *ps, int n, uint va)
+{
+  struct pseg *s, *t;
+
+  for(s = ps; s < &ps[n]; s++){
+    if(va + PGSIZE <= s->va || va >= s->va + s->memsz)
+      continue;
+    if(s->flags & ELF_PROG_FLAG_WRITE)
+      return 0;
+    if(va < s->va || (s->va - s->off) % PGSIZE != 0)
+      return 0;
+    if(va + PGSIZE > s->va + s->filesz && s->memsz != s->filesz)
+      return 0;
+    for(t = ps; t < &ps[n]; t++)
+      if(t != s && va + PGSIZE > t->va && va < t->va + t->memsz)
+        return 0;
+    return s;
+  }
+  return 0;
+}
+
+// Can the 4MB around heap address va be a superpage?  It must lie
+// below p->sz, clear of the program segments, with nothing mapped
+// in it yet.
+static int
+bigok(struct proc *p, uint va)
+{
+  struct pseg *s;
+  uint a;
+
+  a = va - va % SPGSIZE;
+  if(a + SPGSIZE > p->sz || a + SPGSIZE < a || (p->pgdir[PDX(a)] & PTE_P))
+    return 0;
+  for(s = p->pseg; s < &p->pseg[p->npseg]; s++)
+    if(a < s->va + s->memsz && a + SPGSIZE > s->va)
+      return 0;
+  return 1;
+}
+
+// Map page mem at va in p's page table after a fault, if the entry
+// for va still holds old (0, or the PTE_SWAP entry being read back).
+// A thread sharing the page table may have filled it in while this
+// one slept; then mem is freed instead.  Returns 1 if mem was
+// mapped, 0 if it was freed, -1 if there is no memory for a page
+// table or va, below MMAPBASE, is no longer below p->sz.
+int
+uvmmap(struct proc *p, uint va, char *mem, int perm, pte_t old)
+{
+  pte_t *pte;
+
+  acquire(&uvmlock);
+  if((va < MMAPBASE && va >= p->sz) ||
+     (pte = walkpgdir(p->pgdir, (char*)va, 1)) == 0){
+    release(&uvmlock);
+    return -1;
+  }
+  if(*pte != old){
+    release(&uvmlock);
+    kfree(mem);
+    return 0;
+  }
+  *pte = V2P(mem) | perm | PTE_P;
+  release(&uvmlock);
+  return 1;
+}
+
+// Make sure the page holding user address va is backed by
+// physical memory.  sbrk() only moves p->sz and exec() only
+// records the program segments, so pages are allocated here on
+// first touch, either from the page fault handler or before the
+// kernel itself uses a user buffer.  Read-only text is mapped
+// from the page cache and shared with other processes running
+// the same program; other segment pages are private copies read
+// from the executable; bss and heap pages are zero-filled.  Heap
+// stretches that cover a whole empty 4MB get a superpage when
+// kallocbig has a free chunk, to spare the TLB.  Pages that were
+// paged out are read back from swap (see swap.c).
+// Addresses above p->sz belong to mmap() regions (see vmafault).
+// If write is set the page must end up writable.
+// May sleep reading the executable, so it must not be called with
+// a spinlock held.  Threads sharing p->pgdir may fault on the same
+// page at the same time; uvmmap sorts that out.  Returns 0 if the page is mapped, -1 if va lies
+// outside the process, memory is exhausted or the read fails.
+int
+uvmfault(struct proc *p, uint va, int write)
+{
+  char *mem;
+  pte_t *pte;
+  struct pseg *s;
+  struct vma *v;
+  uint a, end, perm;
+  int r;
+
+  v = 0;
+  if(va >= p->sz && (v = vmalookup(p, va)) == 0)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if((pte = walkpgdir(p->pgdir, (char*)va, 0)) != 0 && (*pte & PTE_P)){
+    if(write && !(*pte & PTE_W))
+      return -1;
+    return 0;
+  }
+  if(pte && (*pte & PTE_SWAP))
+    return swapin(p, va, *pte);
+  if(v){
+    // Hold vmlock so that another thread cannot unmap v meanwhile.
+    acquiresleep(&vmlock);
+    if((v = vmalookup(p, va)) != 0)
+      r = vmafault(p, v, va, write);
+    else
+      r = -1;
+    releasesleep(&vmlock);
+    return r;
+  }
+
+  if((s = sharedseg(p->pseg, p->npseg, va)) != 0){
+    if(write)
+      return -1;
+    ilock(p->exe);
+    mem = pcget(p->exe, s->off + (va - s->va), 0);
+    iunlock(p->exe);
+    if(mem == 0)
+      return -1;
+    if(uvmmap(p, va, mem, PTE_U, 0) < 0){
+      kfree(mem);
+      return -1;
+    }
+    return 0;
+  }
+
+  if(bigok(p, va) && (mem = kallocbig()) != 0){
+    memset(mem, 0, SPGSIZE);
+    acquire(&uvmlock);
+    if(bigok(p, va)){
+      p->pgdir[PDX(va)] = V2P(mem) | PTE_P | PTE_W | PTE_U | PTE_PS;
+      mem = 0;
+    }
+    release(&uvmlock);
+    if(mem)
+      kfreebig(mem);
+    return 0;
+  }
+
+  // The page is writable unless it only holds read-only segments.
+  perm = PTE_U|PTE_W;
+  for(s = p->pseg; s < &p->pseg[p->npseg]; s++){
+    if(va + PGSIZE <= s->va || va >= s->va + s->memsz)
+      continue;
+    if(s->flags & ELF_PROG_FLAG_WRITE){
+      perm = PTE_U|PTE_W;
+      break;
+    }
+    perm = PTE_U;
+  }
+  if(write && !(perm & PTE_W))
+    return -1;
+
+  if((mem = swapalloc()) == 0){
+    cprintf("uvmfault out of memory\n");
+    return -1;
+  }
+  for(s = p->pseg; s < &p->pseg[p->npseg]; s++){
+    a = va > s->va ? va : s->va;
+    end = s->va + s->filesz;
+    if(end > va + PGSIZE)
+      end = va + PGSIZE;
+    if(a >= end)
+      continue;
+    ilock(p->exe);
+    if(readi(p->exe, mem + (a - va), s->off + (a - s->va), end - a) != end - a){
+      iunlock(p->exe);
+      kfree(mem);
+      return -1;
+    }
+    iunlock(p->exe);
+  }
+  if(uvmmap(p, va, mem, perm, 0) < 0){
+    cprintf("uvmfault: cannot map page\n");
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Advance the page-out clock hand *va through the memory of p
+// below p->sz.  Pages the hardware has marked accessed since the
+// hand last passed get a second chance: the hand clears PTE_A.
+// Others, if private, writable and outside [pinstart, pinend),
+// the buffers of system calls in progress, are unmapped; their
+// PTEs become PTE_SWAP entries for newly allocated swap slots.
+// Superpages are split first.  Stops after n pages, which are
+// returned in pages[] and slots[] for the caller to write out and
+// free.  Returns the number of pages.  Caller must hold
+// ptable.lock, and no thread using p->pgdir may be running.
+int
+uvmclock(struct proc *p, uint pinstart, uint pinend, uint *va,
+         char **pages, uint *slots, int n)
+{
+  pte_t *pte;
+  uint a, pa;
+  int nv, slot;
+
+  nv = 0;
+  for(a = *va; a < p->sz && nv < n; a += PGSIZE){
+    if((pte = walkpgdir(p->pgdir, (char*)a, 0)) == 0){
+      a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
+    if(*pte & PTE_PS){
+      if((*pte & PTE_A) || splitbig(pte) < 0){
+        *pte &= ~PTE_A;
+        a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+        continue;
+      }
+      pte = walkpgdir(p->pgdir, (char*)a, 0);
+    }
+    if((*pte & (PTE_P|PTE_U|PTE_W)) != (PTE_P|PTE_U|PTE_W))
+      continue;
+    if(*pte & PTE_A){
+      *pte &= ~PTE_A;
+      continue;
+    }
+    if(a + PGSIZE > pinstart && a < pinend)
+      continue;
+    pa = PTE_ADDR(*pte);
+    if(krefcount(P2V(pa)) != 1)
+      continue;
+    if((slot = swapslot()) < 0)
+      break;
+    *pte = (slot << PTXSHIFT) | PTE_SWAP | (*pte & (PTE_U|PTE_W));
+    pages[nv] = P2V(pa);
+    slots[nv] = slot;
+    nv++;
+  }
+  *va = a;
+  return nv;
+}
+
+// Map into pgdir every shareable text page of ip that is already
+// in the page cache, so a program that is running elsewhere starts
+// without faulting its text in again.  ip must be locked.
+void
+uvmmapcached(pde_t *pgdir, struct inode *ip, struct pseg *ps, int n)
+{
+  struct pseg *s;
+  char *mem;
+  uint va;
+
+  for(s = ps; s < &ps[n]; s++){
+    for(va = PGROUNDUP(s->va); va < s->va + s->memsz; va += PGSIZE){
+      if(sharedseg(ps, n, va) != s)
+        continue;
+      if((mem = pclookup(ip, s->off + (va - s->va))) == 0)
+        continue;
+      if(mappages(pgdir, (char*)va, PGSIZE, V2P(mem), PTE_U) < 0){
+        kfree(mem);
+        return;
+      }
+    }
+  }
+}
+
 //PAGEBREAK!
 // Map user virtual address to kernel address.
 char*
@@ -352,10 +847,12 @@ uva2ka(pde_t *pgdir, char *uva)
   pte_t *pte;
 
   pte = walkpgdir(pgdir, uva, 0);
-  if((*pte & PTE_P) == 0)
+  if(pte == 0 || (*pte & PTE_P) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
+  if(*pte & PTE_PS)
+    return (char*)P2V(PTE_ADDR(*pte)) + (uint)uva % SPGSIZE;
   return (char*)P2V(PTE_ADDR(*pte));
 }
 
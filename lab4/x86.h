@@ -9,6 +9,24 @@ inb(ushort port)
   return data;
 }
 
+static inline ushort
+inw(ushort port)
+{
+  ushort data;
+
+  asm volatile("in %1,%0" : "=a" (data) : "d" (port));
+  return data;
+}
+
+static inline uint
+inl(ushort port)
+{
+  uint data;
+
+  asm volatile("in %1,%0" : "=a" (data) : "d" (port));
+  return data;
+}
+
 static inline void
 insl(int port, void *addr, int cnt)
 {
@@ -30,6 +48,12 @@ outw(ushort port, ushort data)
   asm volatile("out %0,%1" : : "a" (data), "d" (port));
 }
 
+static inline void
+outl(ushort port, uint data)
+{
+  asm volatile("out %0,%1" : : "a" (data), "d" (port));
+}
+
 static inline void
 outsl(int port, const void *addr, int cnt)
 {
@@ -57,6 +81,24 @@ stosl(void *addr, int data, int cnt)
                "memory", "cc");
 }
 
+static inline void
+movsb(void *dst, const void *src, int cnt)
+{
+  asm volatile("cld; rep movsb" :
+               "=D" (dst), "=S" (src), "=c" (cnt) :
+               "0" (dst), "1" (src), "2" (cnt) :
+               "memory", "cc");
+}
+
+static inline void
+movsl(void *dst, const void *src, int cnt)
+{
+  asm volatile("cld; rep movsl" :
+               "=D" (dst), "=S" (src), "=c" (cnt) :
+               "0" (dst), "1" (src), "2" (cnt) :
+               "memory", "cc");
+}
+
 struct segdesc;
 
 static inline void
@@ -130,6 +172,20 @@ xchg(volatile uint *addr, uint newval)
   return result;
 }
 
+static inline uint
+rcr0(void)
+{
+  uint val;
+  asm volatile("movl %%cr0,%0" : "=r" (val));
+  return val;
+}
+
+static inline void
+lcr0(uint val)
+{
+  asm volatile("movl %0,%%cr0" : : "r" (val));
+}
+
 static inline uint
 rcr2(void)
 {
@@ -144,6 +200,48 @@ lcr3(uint val)
   asm volatile("movl %0,%%cr3" : : "r" (val));
 }
 
+static inline uint
+rcr3(void)
+{
+  uint val;
+  asm volatile("movl %%cr3,%0" : "=r" (val));
+  return val;
+}
+
+static inline uint
+rcr4(void)
+{
+  uint val;
+  asm volatile("movl %%cr4,%0" : "=r" (val));
+  return val;
+}
+
+static inline void
+lcr4(uint val)
+{
+  asm volatile("movl %0,%%cr4" : : "r" (val));
+}
+
+// Clear CR0_TS, so that FPU instructions no longer trap.
+static inline void
+clts(void)
+{
+  asm volatile("clts");
+}
+
+// Save and restore the FPU/SSE registers; p must be 16-byte aligned.
+static inline void
+fxsave(void *p)
+{
+  asm volatile("fxsave %0" : "=m" (*(char (*)[512])p));
+}
+
+static inline void
+fxrstor(void *p)
+{
+  asm volatile("fxrstor %0" : : "m" (*(char (*)[512])p));
+}
+
 //PAGEBREAK: 36
 // Layout of the trap frame built on the stack by the
 // hardware and by trapasm.S, and passed to trap().